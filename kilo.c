@@ -20,12 +20,25 @@
 #include<ctype.h>
 #include<errno.h>
 #include<fcntl.h>
+#include<limits.h>
+#include<poll.h>
+#include<pthread.h>
+#ifdef KILO_CHECK
+#include<regex.h>
+#endif
+#include<signal.h>
 #include<stdio.h>
 #include<stdarg.h>
+#include<stdint.h>
 #include<stdlib.h>
 #include<string.h>
+#include<strings.h>
 #include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #include<sys/types.h>
+#include<sys/uio.h>
+#include<sys/wait.h>
 #include<termios.h>
 #include<time.h>
 #include<unistd.h>
@@ -35,6 +48,41 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_RENDER_LOOKAHEAD 8
+#define KILO_HL_CHUNK_ROWS 4096
+#define KILO_HL_MAX_THREADS 16
+#define KILO_DIFF_GAP 4
+#define KILO_INPUT_SIZE 4096
+#define KILO_PASTE_WAIT 10
+#define KILO_SEARCH_JOB_ROWS 65536
+#define KILO_RE_MAX_STATES 1024
+#define KILO_RE_SCAN_FACTOR 4
+#define KILO_SAVE_IOVECS 1024
+#define KILO_SAVE_CHUNK (8 << 20)
+#define KILO_SAVE_COPY_MIN (64 << 10)
+#define RE_DEAD 1
+#define RE_MATCHED 2
+#define KILO_KEY_TIMEOUT 100
+#define KILO_MSG_TIMEOUT 5
+#ifndef KILO_JOURNAL_INTERVAL
+#define KILO_JOURNAL_INTERVAL 1000
+#endif
+#define KILO_JOURNAL_MAGIC "KILOJ1"
+#ifndef KILO_UNDO_LIMIT
+#define KILO_UNDO_LIMIT (64 << 20)
+#endif
+#ifdef KILO_BENCH
+/* The benchmark build counts the editor's own allocations. */
+#define malloc(size) benchMalloc(size)
+#define calloc(n, size) benchCalloc(n, size)
+#define realloc(p, size) benchRealloc(p, size)
+#define KILO_BENCH_LOG_ROWS 1000000
+#define KILO_BENCH_JSON_ROWS 200
+#define KILO_BENCH_C_ROWS 200000
+#endif
+#ifndef KILO_FRAME_RATE
+#define KILO_FRAME_RATE 60
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -48,7 +96,9 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END
 };
 
 enum editorHighlight {
@@ -65,8 +115,35 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define ROW_MAPPED (1<<0)
+#define ROW_RENDER_DIRTY (1<<1)
+#define ROW_HL_DIRTY (1<<2)
+#define ROW_STATE_DIRTY (1<<3)
+#define ROW_IN_COMMENT (1<<4)
+#define ROW_SAVING (1<<5)
+
+#define ATTR_INVERSE 0x80
+
+#define SEARCH_IGNORE_CASE (1<<0)
+#define SEARCH_WHOLE_WORD (1<<1)
+#define SEARCH_REGEX (1<<2)
+
 /*** data ***/
 
+struct keywordEntry {
+    const char *word;
+    int len;
+    unsigned char hl;
+};
+
+/* An open addressing hash table of a syntax's keywords, built the first
+ * time the syntax is selected. */
+struct keywordTable {
+    struct keywordEntry *slots;
+    unsigned int mask;
+    int maxLen;
+};
+
 struct editorSyntax {
     char *filetype;
     char **filematch;
@@ -75,18 +152,39 @@ struct editorSyntax {
     char *multilineCommentStart;
     char *multilineCommentEnd;
     int flags;
+    struct keywordTable *keywordTable;
+};
+
+/* Where a tab sits in a row's chars, and the render index just past it. */
+struct tabStop {
+    int cx;
+    int rx;
 };
 
 typedef struct erow {
-    int idx;
     int size;
     int rsize;
     char *chars;
     char *render;
     unsigned char *hl;
     int hlOpenComment;
+    int flags;
+    struct tabStop *tabs;
+    int numTabs;
 } erow;
 
+/* Rows are kept in a gap buffer: rows[0, gapStart) and rows[gapEnd, cap)
+ * hold the lines of the file and the gap between them absorbs insertions
+ * and deletions near the last edit. */
+struct textStore {
+    erow *rows;
+    int cap;
+    int gapStart;
+    int gapEnd;
+};
+
+#define TEXTSTORE_INIT {NULL, 0, 0, 0}
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -95,17 +193,276 @@ struct editorConfig {
     int screenRows;
     int screenCols;
     int numRows;
-    erow *row;
+    int hlValidRows;
+    int hlDirtyEnd;
+    unsigned int hlGen;
+    struct textStore text;
     int dirty;
     char *filename;
     char statusMsg[80];
     time_t statusMsg_time;
+    int prompting;
     struct editorSyntax *syntax;
+    char *map;
+    size_t mapLen;
+    int mapFd;
+    mode_t umask;
+    int headless;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+/* A run of rows whose multi-line comment state is being worked out by a
+ * background thread. The rows' text is captured when the chunk is queued,
+ * and the results are thrown away if the file changes in the meantime. */
+struct hlChunk {
+    unsigned int gen;
+    struct editorSyntax *syntax;
+    int start;
+    int count;
+    int inComment;
+    int knownIn;
+    const char **lines;
+    int *lens;
+    char *copy;
+    unsigned char *states;
+    unsigned char *alt;
+    int altLen;
+    struct hlChunk *next;
+};
+
+struct hlPool {
+    int numThreads;
+    pthread_t threads[KILO_HL_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct hlChunk *todo;
+    struct hlChunk *done;
+    struct hlChunk *ready;
+    int pending;
+};
+
+struct hlPool pool = {0, {0}, PTHREAD_MUTEX_INITIALIZER,
+                      PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, 0};
+
+/* What the terminal is showing, one character and one attribute per cell,
+ * and the frame being drawn over it. Only cells that differ between the
+ * two are sent. An attribute is the foreground colour's SGR code, or 0 for
+ * the default colour, plus ATTR_INVERSE. written counts the bytes sent. */
+struct screenGrid {
+    int rows;
+    int cols;
+    char *chars;
+    unsigned char *attrs;
+    char *nextChars;
+    unsigned char *nextAttrs;
+    int valid;
+    int cursorY;
+    int cursorX;
+    long long lastFrame;
+    int rowOff;
+    long long written;
+};
+
+struct screenGrid screen = {0, 0, NULL, NULL, NULL, NULL, 0, -1, -1, 0, 0,
+                            0};
+
+/* Bytes read from the terminal but not yet decoded into keys. A headless
+ * editor reads them from script instead. */
+struct inputBuf {
+    char buf[KILO_INPUT_SIZE];
+    int start;
+    int end;
+    const char *script;
+    int scriptLen;
+};
+
+struct inputBuf input = {{0}, 0, 0, NULL, 0};
+
+/* A save being written by a background thread. iov is a snapshot of the
+ * text taken when the save started, pointing at the rows' own buffers.
+ * Rows with buffers in the snapshot are flagged ROW_SAVING, and editing
+ * or deleting one of them leaves its old buffer in retired until the save
+ * is over. dirty is E.dirty and journalPos the end of the journal at the
+ * time of the snapshot. deferred is set if the save was not checked on
+ * because a prompt was showing. written, done,
+ * result and err are shared with the saving thread under lock. */
+struct saveJob {
+    int running;
+    int deferred;
+    char *filename;
+    struct iovec *iov;
+    int numIov;
+    int iovCap;
+    off_t total;
+    int dirty;
+    off_t journalPos;
+    char **retired;
+    int numRetired;
+    int retiredCap;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    off_t written;
+    int done;
+    off_t result;
+    int err;
+};
+
+struct saveJob save = {0, 0, NULL, NULL, 0, 0, 0, 0, 0, NULL, 0, 0, 0,
+                       PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0};
+
+/* Written to by the SIGWINCH handler and the background threads to wake
+ * the main loop. */
+int wakePipe[2] = {-1, -1};
+volatile sig_atomic_t resized = 0;
+
+enum reOp {
+    RE_CLASS,
+    RE_SPLIT,
+    RE_EMPTY,
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH
+};
+
+/* Which ends of a line a position is at, for RE_BOL and RE_EOL. */
+#define RE_AT_BOL 1
+#define RE_AT_EOL 2
+
+/* A state of a Thompson NFA. RE_CLASS consumes one byte that is in cls
+ * and moves to out, RE_SPLIT moves to both out and out1 without consuming
+ * anything, RE_EMPTY moves to out, RE_BOL and RE_EOL move to out only at
+ * the start and end of the line, and RE_MATCH accepts. */
+struct reState {
+    int op;
+    int out;
+    int out1;
+    unsigned char cls[32];
+};
+
+struct reProg {
+    struct reState *states;
+    int numStates;
+    int cap;
+    int start;
+};
+
+/* A compiled pattern, as an NFA for matching forwards and another for
+ * matching the reversed pattern backwards. */
+struct regex {
+    struct reProg fwd;
+    struct reProg rev;
+};
+
+/* A state of a lazily built DFA: the set of NFA states it stands for.
+ * RE_BOL and RE_EOL states are kept in the set until the DFA reaches an
+ * end of the line, and edge holds the state it moves to there, indexed
+ * by RE_AT_BOL and RE_AT_EOL, or -1 where that is not yet known. */
+struct reDfaState {
+    int *set;
+    int n;
+    int match;
+    int edge[4];
+};
+
+/* A DFA built from an NFA as it is needed. When an unanchored DFA moves,
+ * it also starts a new match at every byte. The moves are kept in one
+ * table with 256 entries per state, each either -1 where the move is not
+ * yet known or the next state shifted left by two with RE_MATCHED and
+ * RE_DEAD in the low bits, so a step is a single lookup. Once
+ * KILO_RE_MAX_STATES states have been built, they are thrown away and
+ * built again. */
+struct reDfa {
+    struct reProg *prog;
+    int unanchored;
+    struct reDfaState **states;
+    int numStates;
+    int *trans;
+    int transCap;
+    int *table;
+    int start;
+    int *work;
+    int *stack;
+    int *mark;
+    int gen;
+};
+
+/* The DFAs and NFA threads used to run a pattern, which are not shared
+ * between threads, and scratch arrays of where matches start on a line and
+ * where the longest match from each of those places ends. A thread is a
+ * state of the reversed NFA along with the end of the match it is
+ * building. */
+struct reMatcher {
+    struct regex *re;
+    struct reDfa fwd;
+    struct reDfa rev;
+    unsigned char *starts;
+    int *ends;
+    int startsCap;
+    int *threads[2];
+    int *threadEnds[2];
+    int *stack;
+    int *mark;
+    int gen;
+};
+
+/* Where a match for the search starts. */
+struct searchMatch {
+    int row;
+    int offset;
+    int len;
+};
+
+/* Where a match is drawn: render columns rx up to rxEnd of a row. match
+ * is its index in the list of matches. */
+struct searchSpan {
+    int row;
+    int rx;
+    int rxEnd;
+    long long match;
+};
+
+/* The search in progress. matches holds every occurrence of query in the
+ * file, in order, found with the settings in matchFlags. In regex mode re
+ * is the compiled query, or NULL with error set if it did not compile.
+ * current is the index of the match the cursor is on, or -1. spans holds
+ * the matches in rows spanTop up to spanBottom as they are drawn, and is
+ * only worked out again when the matches or those rows change. */
+struct searchState {
+    int active;
+    int flags;
+    char *query;
+    int queryLen;
+    int matchFlags;
+    struct regex *re;
+    const char *error;
+    struct searchMatch *matches;
+    long long numMatches;
+    long long cap;
+    long long current;
+    struct searchSpan *spans;
+    int numSpans;
+    int spanCap;
+    int spanTop;
+    int spanBottom;
+};
+
+struct searchState search = {0, 0, NULL, 0, 0, NULL, NULL, NULL, 0, 0, -1,
+                             NULL, 0, 0, 0, -1};
+
+/* A range of rows searched by one thread. threaded is set if the range
+ * is being searched on a thread of its own. */
+struct searchJob {
+    int start;
+    int end;
+    struct searchMatch *matches;
+    long long numMatches;
+    long long cap;
+    int threaded;
+    pthread_t thread;
+};
+
 /*** filetypes ***/
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -123,7 +480,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     }
 };
 
@@ -132,8 +490,22 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorRenderRow(erow *row);
 void editorRefreshScreen();
+void editorWaitForInput();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoInsert(int row, int col, const char *s, int len);
+void editorUndoDelete(int row, int col, const char *s, int len);
+void editorJournalInsert(int row, int col, const char *s, int len);
+void editorJournalDelete(int row, int col, int len);
+off_t editorJournalMark();
+void editorJournalSaved(off_t pos);
+void initEditor();
+#ifdef KILO_BENCH
+void *benchMalloc(size_t size);
+void *benchCalloc(size_t n, size_t size);
+void *benchRealloc(void *p, size_t size);
+#endif
 
 /*** terminal ***/
 
@@ -154,6 +526,7 @@ void die(const char *msg) {
  * Return terminal settings to its original configuration.
  */
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // stop bracketing pastes
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("disableRawMode: tcsetattr");
 }
@@ -172,10 +545,108 @@ void enableRawMode() {
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("enableRawMode: tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracket pastes
+}
+
+/**
+ * Read a clock that only ever moves forwards.
+ *
+ * return: Time in milliseconds.
+ */
+long long editorNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Read whatever input is available into the input buffer with a single
+ * read, waiting a while for some to arrive.
+ *
+ * param timeout: Milliseconds to wait, or -1 to wait for as long as it
+ *     takes.
+ * return: Number of bytes read.
+ */
+int inputFill(int timeout) {
+    if (input.start == input.end) {
+        input.start = 0;
+        input.end = 0;
+    } else if (input.end == KILO_INPUT_SIZE) {
+        memmove(input.buf, &input.buf[input.start], input.end - input.start);
+        input.end -= input.start;
+        input.start = 0;
+    }
+    if (input.end == KILO_INPUT_SIZE)
+        return 0;
+
+    if (E.headless) {
+        int n = KILO_INPUT_SIZE - input.end;
+        if (n > input.scriptLen)
+            n = input.scriptLen;
+        memcpy(&input.buf[input.end], input.script, n);
+        input.script += n;
+        input.scriptLen -= n;
+        input.end += n;
+        return n;
+    }
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    int nread = read(STDIN_FILENO, &input.buf[input.end],
+                     KILO_INPUT_SIZE - input.end);
+    if (nread == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            die("inputFill: read");
+        return 0;
+    }
+    if (nread == 0) {
+        /* Readable with nothing to read: the terminal has gone away. */
+        errno = EIO;
+        die("inputFill: read");
+    }
+    input.end += nread;
+    return nread;
+}
+
+/**
+ * Take the next byte of input, reading more if none is buffered.
+ *
+ * param c: Where to store the byte.
+ * return: 1 if a byte was taken, 0 if none arrived in time.
+ */
+int inputRead(char *c) {
+    if (input.start == input.end && inputFill(KILO_KEY_TIMEOUT) == 0)
+        return 0;
+    *c = input.buf[input.start++];
+    return 1;
+}
+
+/**
+ * Look at a byte of input without taking it, reading more if needed.
+ *
+ * param i: How far past the next byte to look.
+ * return: The byte, or -1 if it did not arrive in time.
+ */
+int inputPeek(int i) {
+    while (input.end - input.start <= i)
+        if (inputFill(KILO_KEY_TIMEOUT) == 0)
+            return -1;
+    return (unsigned char)input.buf[input.start + i];
+}
+
+/**
+ * Check whether input has been read that is not yet decoded.
+ *
+ * return: 1 if there is buffered input, 0 if not.
+ */
+int inputPending() {
+    return input.start < input.end;
 }
 
 /**
@@ -184,25 +655,31 @@ void enableRawMode() {
  *  return: A char that has been entered by the user, encoded as an int.
  */
 int editorReadKey() {
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-        if (nread == -1 && errno != EAGAIN)
-            die("editorReadKey: read");
+    while (!inputPending())
+        editorWaitForInput();
+    inputRead(&c);
     
     if (c == '\x1b') {
-        char seq[3];
+        char seq[5];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if (inputRead(&seq[0]) != 1)
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (inputRead(&seq[1]) != 1)
             return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if (inputRead(&seq[2]) != 1)
                     return '\x1b';
-                if (seq[2] == '~') {
+                if (seq[1] == '2' && seq[2] == '0') {
+                    if (inputRead(&seq[3]) != 1 || inputRead(&seq[4]) != 1)
+                        return '\x1b';
+                    if (seq[3] == '0' && seq[4] == '~')
+                        return PASTE_START;
+                    if (seq[3] == '1' && seq[4] == '~')
+                        return PASTE_END;
+                } else if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1':
                             return HOME_KEY;
@@ -266,7 +743,7 @@ int getCursorPosition(int *rows, int *cols) {
         return -1;
 
     while (i < sizeof(buf) -1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+        if (inputRead(&buf[i]) != 1)
             break;
         if (buf[i] == 'R')
             break;
@@ -303,6 +780,90 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** text store ***/
+
+/**
+ * Return a pointer to a row in a text store. The pointer is only valid
+ * until the next insertion or deletion.
+ *
+ * param ts: The text store.
+ * param at: Index of the row.
+ */
+erow *tsRow(struct textStore *ts, int at) {
+    if (at >= ts->gapStart)
+        at += ts->gapEnd - ts->gapStart;
+    return &ts->rows[at];
+}
+
+/**
+ * Return the index of a row in a text store.
+ *
+ * param ts: The text store.
+ * param row: A row previously returned by tsRow().
+ */
+int tsIndexOf(struct textStore *ts, erow *row) {
+    int at = row - ts->rows;
+    if (at >= ts->gapEnd)
+        at -= ts->gapEnd - ts->gapStart;
+    return at;
+}
+
+/**
+ * Move the gap so that it starts at a given row. Only the rows between
+ * the old and new gap position are moved.
+ *
+ * param ts: The text store.
+ * param at: Index of the row the gap should start at.
+ */
+void tsMoveGap(struct textStore *ts, int at) {
+    if (at < ts->gapStart) {
+        int n = ts->gapStart - at;
+        memmove(&ts->rows[ts->gapEnd - n], &ts->rows[at], sizeof(erow) * n);
+        ts->gapStart -= n;
+        ts->gapEnd -= n;
+    } else if (at > ts->gapStart) {
+        int n = at - ts->gapStart;
+        memmove(&ts->rows[ts->gapStart], &ts->rows[ts->gapEnd],
+                sizeof(erow) * n);
+        ts->gapStart += n;
+        ts->gapEnd += n;
+    }
+}
+
+/**
+ * Open up an uninitialised row in a text store.
+ *
+ * param ts: The text store.
+ * param at: Index the new row will have.
+ * return: A pointer to the new row.
+ */
+erow *tsInsert(struct textStore *ts, int at) {
+    if (ts->gapStart == ts->gapEnd) {
+        int newCap = ts->cap ? ts->cap * 2 : 16;
+        int tail = ts->cap - ts->gapEnd;
+        ts->rows = realloc(ts->rows, sizeof(erow) * newCap);
+        if (ts->rows == NULL)
+            die("tsInsert: realloc");
+        memmove(&ts->rows[newCap - tail], &ts->rows[ts->gapEnd],
+                sizeof(erow) * tail);
+        ts->gapEnd = newCap - tail;
+        ts->cap = newCap;
+    }
+    tsMoveGap(ts, at);
+    return &ts->rows[ts->gapStart++];
+}
+
+/**
+ * Remove a row from a text store. The row's memory is not freed.
+ *
+ * param ts: The text store.
+ * param at: Index of the row to remove.
+ */
+void tsDelete(struct textStore *ts, int at) {
+    tsMoveGap(ts, at);
+    ts->gapEnd++;
+}
+
 /*** syntax highlighting ***/
 
 /**
@@ -315,22 +876,120 @@ int isSeparator(int c) {
 }
 
 /**
- * Determine what characters in a line need to be highlighted.
+ * Hash a string of a given length (FNV-1a).
+ *
+ * param s: The string.
+ * param len: Length of the string.
+ */
+unsigned int keywordHash(const char *s, int len) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Build the keyword table for a syntax. Keywords ending in '|' are
+ * secondary keywords; the '|' is not part of the keyword.
+ *
+ * param syntax: The syntax to build a table for.
+ */
+void editorCompileKeywords(struct editorSyntax *syntax) {
+    struct keywordTable *t = malloc(sizeof(*t));
+    int n = 0;
+    while (syntax->keywords[n])
+        n++;
+
+    unsigned int size = 8;
+    while (size < (unsigned int)n * 2)
+        size *= 2;
+    t->slots = calloc(size, sizeof(*t->slots));
+    t->mask = size - 1;
+    t->maxLen = 0;
+
+    int j;
+    for (j = 0; j < n; j++) {
+        const char *word = syntax->keywords[j];
+        int len = strlen(word);
+        int kw2 = (len > 0 && word[len - 1] == '|');
+        if (kw2)
+            len--;
+        if (len == 0)
+            continue;
+
+        unsigned int h = keywordHash(word, len) & t->mask;
+        while (t->slots[h].word) {
+            if (t->slots[h].len == len && !memcmp(t->slots[h].word, word, len))
+                break;
+            h = (h + 1) & t->mask;
+        }
+        if (t->slots[h].word)
+            continue;
+        t->slots[h].word = word;
+        t->slots[h].len = len;
+        t->slots[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if (len > t->maxLen)
+            t->maxLen = len;
+    }
+
+    syntax->keywordTable = t;
+}
+
+/**
+ * Look up the word starting at the beginning of a string. The word runs
+ * up to the next separator, so it is found in time proportional to its
+ * length however many keywords the syntax has.
+ *
+ * param t: A keyword table.
+ * param s: Start of the word.
+ * param len: Number of characters available from s.
+ * param klen: Set to the length of the keyword if one is found.
+ * return: The highlight of the keyword, or HL_NORMAL if it is not one.
+ */
+int keywordLookup(struct keywordTable *t, const char *s, int len, int *klen) {
+    int n = 0;
+    while (n < len && n <= t->maxLen && !isSeparator(s[n]))
+        n++;
+    if (n == 0 || n > t->maxLen)
+        return HL_NORMAL;
+
+    unsigned int h = keywordHash(s, n) & t->mask;
+    while (t->slots[h].word) {
+        if (t->slots[h].len == n && !memcmp(t->slots[h].word, s, n)) {
+            *klen = n;
+            return t->slots[h].hl;
+        }
+        h = (h + 1) & t->mask;
+    }
+    return HL_NORMAL;
+}
+
+/**
+ * Determine what characters in a line need to be highlighted. This only
+ * reads its arguments, so it is safe to call from a background thread.
  *
- * param row: A line of characters.
+ * param syntax: The highlighting scheme to use, or NULL for none.
+ * param s: A line of characters.
+ * param len: Length of the line.
+ * param hl: Highlight array of len bytes to fill in, or NULL if only the
+ *           multi-line comment state at the end of the line is wanted.
+ * param inComment: Whether the line starts inside a multi-line comment.
+ * return: Whether the line ends inside a multi-line comment.
  */
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+int editorHighlightLine(struct editorSyntax *syntax, const char *s, int len,
+                        unsigned char *hl, int inComment) {
+    if (hl)
+        memset(hl, HL_NORMAL, len);
     
-    if (E.syntax == NULL)
-        return;
+    if (syntax == NULL)
+        return 0;
     
-    char **keywords = E.syntax->keywords; 
-
-    char *scs = E.syntax->singlelineCommentStart;
-    char *mcs = E.syntax->multilineCommentStart;
-    char *mce = E.syntax->multilineCommentEnd;
+    char *scs = syntax->singlelineCommentStart;
+    char *mcs = syntax->multilineCommentStart;
+    char *mce = syntax->multilineCommentEnd;
 
     int scsLen = scs ? strlen(scs) : 0;
     int mcsLen = mcs ? strlen(mcs) : 0;
@@ -338,25 +997,27 @@ void editorUpdateSyntax(erow *row) {
 
     int prevSep = 1;
     int inString = 0;
-    int inComment = (row->idx > 0 && E.row[row->idx - 1].hlOpenComment);
 
     int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prevHl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    while (i < len) {
+        char c = s[i];
+        unsigned char prevHl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
 
         if (scsLen && !inString && !inComment) {
-            if (!strncmp(&row->render[i], scs, scsLen)){
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+            if (i + scsLen <= len && !memcmp(&s[i], scs, scsLen)) {
+                if (hl)
+                    memset(&hl[i], HL_COMMENT, len - i);
                 break;
             }
         }
 
         if(mcsLen && mceLen && !inString) {
             if (inComment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mceLen)){
-                    memset(&row->hl[i], HL_MLCOMMENT, mceLen);
+                if (hl)
+                    hl[i] = HL_MLCOMMENT;
+                if (i + mceLen <= len && !memcmp(&s[i], mce, mceLen)) {
+                    if (hl)
+                        memset(&hl[i], HL_MLCOMMENT, mceLen);
                     i += mceLen;
                     inComment = 0;
                     prevSep = 1;
@@ -365,19 +1026,22 @@ void editorUpdateSyntax(erow *row) {
                     i++;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcsLen)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcsLen);
+            } else if (i + mcsLen <= len && !memcmp(&s[i], mcs, mcsLen)) {
+                if (hl)
+                    memset(&hl[i], HL_MLCOMMENT, mcsLen);
                 i += mcsLen;
                 inComment = 1;
                 continue;
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (inString) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
+                if (hl)
+                    hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    if (hl)
+                        hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -389,17 +1053,24 @@ void editorUpdateSyntax(erow *row) {
             } else {
                 if (c == '"' || c == '\'') {
                     inString = c;
-                    row->hl[i] = HL_STRING;
+                    if (hl)
+                        hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+        /* Numbers and keywords never change the comment state. */
+        if (hl == NULL) {
+            i++;
+            continue;
+        }
+
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             if ((isdigit(c) && (prevSep || prevHl == HL_NUMBER)) ||
                 (c == '.' && prevHl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prevSep = 0;
                 continue;
@@ -407,20 +1078,12 @@ void editorUpdateSyntax(erow *row) {
         }
 
         if (prevSep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    isSeparator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+            int klen;
+            int kwHl = keywordLookup(syntax->keywordTable, &s[i], len - i,
+                                     &klen);
+            if (kwHl != HL_NORMAL) {
+                memset(&hl[i], kwHl, klen);
+                i += klen;
                 prevSep = 0;
                 continue;
             }
@@ -430,10 +1093,37 @@ void editorUpdateSyntax(erow *row) {
         i++;
     }
 
-    int changed = (row->hlOpenComment != inComment);
-    row->hlOpenComment = inComment;
-    if (changed && row->idx + 1 < E.numRows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    return inComment;
+}
+
+/**
+ * Highlight a line of text, or only work out its multi-line comment state
+ * if it is not about to be drawn. The line before it must have an up to
+ * date multi-line comment state.
+ *
+ * param row: A line of characters. Its render must be up to date if full
+ *            is set.
+ * param full: Whether to fill in the row's hl array.
+ */
+void editorUpdateSyntax(erow *row, int full) {
+    int at = tsIndexOf(&E.text, row);
+    int inComment = (at > 0 && tsRow(&E.text, at - 1)->hlOpenComment);
+
+    if (full) {
+        row->hl = realloc(row->hl, row->rsize);
+        row->hlOpenComment = editorHighlightLine(E.syntax, row->render,
+                                                 row->rsize, row->hl,
+                                                 inComment);
+        row->flags &= ~ROW_HL_DIRTY;
+    } else {
+        row->hlOpenComment = editorHighlightLine(E.syntax, row->chars,
+                                                 row->size, NULL, inComment);
+        row->flags |= ROW_HL_DIRTY;
+    }
+
+    row->flags &= ~(ROW_STATE_DIRTY | ROW_IN_COMMENT);
+    if (inComment)
+        row->flags |= ROW_IN_COMMENT;
 }
 
 /**
@@ -468,6 +1158,13 @@ int editorSyntaxToColor(int hl) {
  * file extension.
  */
 void editorSelectSyntaxHighlight() {
+    int filerow;
+    for (filerow = 0; filerow < E.numRows; filerow++)
+        tsRow(&E.text, filerow)->flags |= ROW_HL_DIRTY | ROW_STATE_DIRTY;
+    E.hlValidRows = 0;
+    E.hlDirtyEnd = E.numRows;
+    E.hlGen++;
+
     E.syntax = NULL;
     if (E.filename == NULL)
         return;
@@ -482,12 +1179,8 @@ void editorSelectSyntaxHighlight() {
             if ((isExt && ext && !strcmp(ext, s->filematch[i])) ||
                 (!isExt && strstr(E.filename, s->filematch[i]))) {
                     E.syntax = s;
-
-                    int filerow;
-                    for (filerow = 0; filerow < E.numRows; filerow++) {
-                        editorUpdateSyntax(&E.row[filerow]);
-                    }
-
+                    if (s->keywordTable == NULL)
+                        editorCompileKeywords(s);
                     return;
                 }
             i++;
@@ -495,140 +1188,598 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
-/*** row operations ***/
+/*** background highlighting ***/
 
 /**
- * Convert a chars index into a render index.
+ * Work out the multi-line comment state at the end of every row in a
+ * chunk. Unless the chunk's incoming state is known, it is assumed to be
+ * outside a comment, and the states for the opposite case are also kept
+ * for as long as they differ.
  *
- * param row: A line in the file.
- * param cx: Chars index.
+ * param c: The chunk to process.
  */
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
+void hlChunkRun(struct hlChunk *c) {
+    int in = c->inComment;
     int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
+    for (j = 0; j < c->count; j++) {
+        in = editorHighlightLine(c->syntax, c->lines[j], c->lens[j], NULL, in);
+        c->states[j] = in;
+    }
+
+    c->altLen = 0;
+    if (c->knownIn)
+        return;
+    in = !c->inComment;
+    for (j = 0; j < c->count; j++) {
+        in = editorHighlightLine(c->syntax, c->lines[j], c->lens[j], NULL, in);
+        if (in == c->states[j])
+            break;
+        c->alt[j] = in;
     }
-    return rx;
+    c->altLen = j;
 }
 
 /**
- * Convert a render index into a chars index.
+ * Free a chunk.
  *
- * param row: A line in the file.
- * param rx: Render index.
+ * param c: The chunk to free.
  */
-int editorRowRxToCx(erow *row, int rx) {
-    int curRx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            curRx += (KILO_TAB_STOP - 1) - (curRx % KILO_TAB_STOP);
-        curRx++;
+void hlChunkFree(struct hlChunk *c) {
+    free(c->lines);
+    free(c->lens);
+    free(c->copy);
+    free(c->states);
+    free(c->alt);
+    free(c);
+}
 
-        if (curRx > rx)
-            return cx;
+/**
+ * Main loop of a background highlighting thread.
+ *
+ * param arg: Unused.
+ */
+void *hlWorker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.todo == NULL)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        struct hlChunk *c = pool.todo;
+        pool.todo = c->next;
+        pthread_mutex_unlock(&pool.lock);
+
+        hlChunkRun(c);
+
+        pthread_mutex_lock(&pool.lock);
+        c->next = pool.done;
+        pool.done = c;
+        write(wakePipe[1], "h", 1);
     }
-    return cx;
+    return NULL;
 }
 
 /**
- * Copy a line of text into a special buffer for rendering characters
- * such as tabs.
+ * Start the background highlighting threads, one per online CPU.
+ */
+void hlPoolStart() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    if (cpus > KILO_HL_MAX_THREADS)
+        cpus = KILO_HL_MAX_THREADS;
+
+    while (pool.numThreads < cpus) {
+        if (pthread_create(&pool.threads[pool.numThreads], NULL, hlWorker,
+                           NULL) != 0)
+            break;
+        pool.numThreads++;
+    }
+}
+
+/**
+ * Copy the rows of a chunk out of the text store so that a background
+ * thread can read them while the file is being edited. Rows that point
+ * into the memory mapped file never change, so they are not copied.
  *
- * param row: Line of text to copy through.
+ * param start: Index of the first row in the chunk.
+ * param count: Number of rows in the chunk.
+ * return: The new chunk.
  */
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+struct hlChunk *hlChunkNew(int start, int count) {
+    struct hlChunk *c = malloc(sizeof(*c));
+    c->gen = E.hlGen;
+    c->syntax = E.syntax;
+    c->start = start;
+    c->count = count;
+    c->inComment = 0;
+    c->knownIn = 0;
+    c->lines = malloc(sizeof(*c->lines) * count);
+    c->lens = malloc(sizeof(*c->lens) * count);
+    c->states = malloc(count);
+    c->alt = malloc(count);
+    c->altLen = 0;
+    c->next = NULL;
+
+    size_t copyLen = 0;
     int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+    for (j = 0; j < count; j++) {
+        erow *row = tsRow(&E.text, start + j);
+        if (!(row->flags & ROW_MAPPED))
+            copyLen += row->size;
+    }
+    c->copy = copyLen ? malloc(copyLen) : NULL;
+
+    char *p = c->copy;
+    for (j = 0; j < count; j++) {
+        erow *row = tsRow(&E.text, start + j);
+        c->lens[j] = row->size;
+        if (row->flags & ROW_MAPPED) {
+            c->lines[j] = row->chars;
+        } else {
+            memcpy(p, row->chars, row->size);
+            c->lines[j] = p;
+            p += row->size;
+        }
+    }
+    return c;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+/**
+ * Apply a finished chunk to the rows from E.hlValidRows onwards. The row
+ * before the chunk must already have an up to date state.
+ *
+ * param c: A chunk that covers E.hlValidRows.
+ */
+void hlChunkApply(struct hlChunk *c) {
+    int in = (c->start > 0 && tsRow(&E.text, c->start - 1)->hlOpenComment);
+    int useAlt = (!c->knownIn && in != c->inComment);
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
+    int j;
+    for (j = 0; j < c->count; j++) {
+        int out = (useAlt && j < c->altLen) ? c->alt[j] : c->states[j];
+        if (c->start + j >= E.hlValidRows) {
+            erow *row = tsRow(&E.text, c->start + j);
+            if ((row->flags & ROW_STATE_DIRTY) ||
+                !(row->flags & ROW_IN_COMMENT) != !in)
+                row->flags |= ROW_HL_DIRTY;
+            row->flags &= ~(ROW_STATE_DIRTY | ROW_IN_COMMENT);
+            if (in)
+                row->flags |= ROW_IN_COMMENT;
+            row->hlOpenComment = out;
         }
+        in = out;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    E.hlValidRows = c->start + c->count;
+    if (E.hlValidRows == E.numRows)
+        E.hlDirtyEnd = 0;
 }
 
 /**
- * Allocate memory for a row of text.
- *
- * param at: The row index to insert at.
- * param s: Row of text to add.
- * param len: Length of the row.
+ * Pick up chunks that the background threads have finished and apply
+ * them to the file, as far as the rows before them allow. Chunks that
+ * were started before the file last changed are discarded.
  */
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numRows)
+void editorCollectHighlights() {
+    if (pool.pending == 0)
         return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numRows - at));
-    for (int j = at + 1; j <= E.numRows; j++)
-        E.row[j].idx++;
+    pthread_mutex_lock(&pool.lock);
+    struct hlChunk **pc = &pool.todo;
+    while (*pc) {
+        struct hlChunk *c = *pc;
+        if (c->gen != E.hlGen) {
+            *pc = c->next;
+            hlChunkFree(c);
+            pool.pending--;
+        } else {
+            pc = &c->next;
+        }
+    }
+    struct hlChunk *done = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    while (done) {
+        struct hlChunk *c = done;
+        done = c->next;
+        pool.pending--;
+        if (c->gen != E.hlGen) {
+            hlChunkFree(c);
+            continue;
+        }
+        pc = &pool.ready;
+        while (*pc && (*pc)->start < c->start)
+            pc = &(*pc)->next;
+        c->next = *pc;
+        *pc = c;
+    }
+
+    while (pool.ready) {
+        struct hlChunk *c = pool.ready;
+        if (c->gen != E.hlGen ||
+            c->start + c->count <= E.hlValidRows) {
+            pool.ready = c->next;
+            hlChunkFree(c);
+        } else if (c->start <= E.hlValidRows) {
+            hlChunkApply(c);
+            pool.ready = c->next;
+            hlChunkFree(c);
+        } else {
+            break;
+        }
+    }
+}
 
-    E.row[at].idx = at;
+/**
+ * Hand the rows past E.hlValidRows to the background threads, so that
+ * jumping further into a large file does not have to work out every
+ * row's multi-line comment state first.
+ */
+void editorHighlightInBackground() {
+    editorCollectHighlights();
+    if (pool.pending > 0 || E.syntax == NULL ||
+        E.numRows - E.hlValidRows < KILO_HL_CHUNK_ROWS)
+        return;
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    if (pool.numThreads == 0)
+        hlPoolStart();
+    if (pool.numThreads == 0)
+        return;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hlOpenComment = 0;
-    editorUpdateRow(&E.row[at]);
+    struct hlChunk *first = NULL;
+    struct hlChunk **tail = &first;
+    int at;
+    for (at = E.hlValidRows; at < E.numRows; at += KILO_HL_CHUNK_ROWS) {
+        int count = E.numRows - at;
+        if (count > KILO_HL_CHUNK_ROWS)
+            count = KILO_HL_CHUNK_ROWS;
+        struct hlChunk *c = hlChunkNew(at, count);
+        if (at == E.hlValidRows) {
+            c->inComment = (at > 0 && tsRow(&E.text, at - 1)->hlOpenComment);
+            c->knownIn = 1;
+        }
+        *tail = c;
+        tail = &c->next;
+        pool.pending++;
+    }
 
-    E.numRows++;
-    E.dirty++;
+    pthread_mutex_lock(&pool.lock);
+    *tail = pool.todo;
+    pool.todo = first;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
 }
 
+/*** row operations ***/
+
 /**
- * Free the memory associated with storing and rendering a line.
+ * Find the last tab in a line that comes before a chars index.
  *
- * param row: The line to free.
+ * param row: A rendered line in the file.
+ * param cx: Chars index.
+ * return: Index into row->tabs, or -1 if there is no such tab.
  */
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+int editorRowTabBefore(erow *row, int cx) {
+    int lo = 0;
+    int hi = row->numTabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].cx < cx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
 }
 
 /**
- * Delete a line of text.
+ * Convert a chars index into a render index.
  *
- * param at: The line the cursor is at.
+ * param row: A line in the file.
+ * param cx: Chars index.
  */
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numRows)
-        return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1],
-            sizeof(erow) * (E.numRows - at - 1));
-    for (int j = at; j < E.numRows - 1; j++)
-        E.row[j].idx--;
-    E.numRows--;
-    E.dirty++;
+int editorRowCxToRx(erow *row, int cx) {
+    editorRenderRow(row);
+    if (row->numTabs == 0)
+        return cx;
+
+    int t = editorRowTabBefore(row, cx);
+    if (t < 0)
+        return cx;
+    return row->tabs[t].rx + (cx - row->tabs[t].cx - 1);
 }
 
 /**
- * Insert a single character into a line at the cursor.
+ * Convert a render index into a chars index.
+ *
+ * param row: A line in the file.
+ * param rx: Render index.
+ */
+int editorRowRxToCx(erow *row, int rx) {
+    editorRenderRow(row);
+
+    /* Find the first tab that ends past rx. */
+    int lo = 0;
+    int hi = row->numTabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (row->tabs[mid].rx <= rx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* rx is either inside that tab or in the run of characters before
+     * it, which map one to one. */
+    int runCx = lo > 0 ? row->tabs[lo - 1].cx + 1 : 0;
+    int runRx = lo > 0 ? row->tabs[lo - 1].rx : 0;
+    int cx = runCx + (rx - runRx);
+    if (lo < row->numTabs && cx > row->tabs[lo].cx)
+        cx = row->tabs[lo].cx;
+    if (cx > row->size)
+        cx = row->size;
+    return cx;
+}
+
+/**
+ * Copy a line of text into a special buffer for rendering characters
+ * such as tabs, if it has changed since it was last rendered. Tabs are
+ * found with memchr(), which libc vectorises, and where each one ends up
+ * is kept in row->tabs to convert between chars and render indices.
+ *
+ * param row: Line of text to copy through.
+ */
+void editorRenderRow(erow *row) {
+    if (!(row->flags & ROW_RENDER_DIRTY))
+        return;
+
+    int capTabs = row->numTabs;
+    row->numTabs = 0;
+
+    const char *p = row->chars;
+    const char *end = row->chars + row->size;
+    const char *tab;
+    int cx = 0;
+    int rx = 0;
+    while ((tab = memchr(p, '\t', end - p)) != NULL) {
+        int tabCx = tab - row->chars;
+        rx += tabCx - cx;
+        rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+        if (row->numTabs == capTabs) {
+            capTabs = capTabs ? capTabs * 2 : 4;
+            row->tabs = realloc(row->tabs, sizeof(*row->tabs) * capTabs);
+        }
+        row->tabs[row->numTabs].cx = tabCx;
+        row->tabs[row->numTabs].rx = rx;
+        row->numTabs++;
+        cx = tabCx + 1;
+        p = tab + 1;
+    }
+    row->rsize = rx + (row->size - cx);
+
+    free(row->render);
+    row->render = malloc(row->rsize + 1);
+
+    int from = 0;
+    int idx = 0;
+    int t;
+    for (t = 0; t < row->numTabs; t++) {
+        int run = row->tabs[t].cx - from;
+        memcpy(&row->render[idx], &row->chars[from], run);
+        idx += run;
+        memset(&row->render[idx], ' ', row->tabs[t].rx - idx);
+        idx = row->tabs[t].rx;
+        from = row->tabs[t].cx + 1;
+    }
+    memcpy(&row->render[idx], &row->chars[from], row->size - from);
+    row->render[row->rsize] = '\0';
+
+    row->flags &= ~ROW_RENDER_DIRTY;
+    row->flags |= ROW_HL_DIRTY;
+}
+
+/**
+ * Note that a line of text has changed. Its render and highlighting are
+ * rebuilt the next time it is drawn.
+ *
+ * param row: The line that changed.
+ */
+void editorUpdateRow(erow *row) {
+    int at = tsIndexOf(&E.text, row);
+    row->flags |= ROW_RENDER_DIRTY | ROW_HL_DIRTY | ROW_STATE_DIRTY;
+    if (at < E.hlValidRows)
+        E.hlValidRows = at;
+    E.hlGen++;
+    if (E.hlDirtyEnd < at + 1)
+        E.hlDirtyEnd = at + 1;
+}
+
+/**
+ * Move E.hlValidRows past one more row. The highlighter is only run over
+ * the row if its cached multi-line comment state can no longer be
+ * trusted, which stops any change from propagating further than it has
+ * to. Rows from E.hlDirtyEnd onwards have not changed since they were
+ * last highlighted, so once one of them is found to start in the same
+ * state as last time, the rest of the file is known to be up to date.
+ *
+ * param full: Whether the row is about to be drawn and needs its hl.
+ */
+void editorSyntaxStep(int full) {
+    int at = E.hlValidRows;
+    erow *row = tsRow(&E.text, at);
+    int inComment = (at > 0 && tsRow(&E.text, at - 1)->hlOpenComment);
+
+    if (!(row->flags & ROW_STATE_DIRTY) &&
+        !(row->flags & ROW_IN_COMMENT) == !inComment) {
+        if (at >= E.hlDirtyEnd) {
+            E.hlValidRows = E.numRows;
+            E.hlDirtyEnd = 0;
+        } else {
+            E.hlValidRows++;
+        }
+        return;
+    }
+
+    if (full)
+        editorRenderRow(row);
+    editorUpdateSyntax(row, full);
+    E.hlValidRows++;
+}
+
+/**
+ * Bring the render and highlighting of a range of rows up to date. Rows
+ * before the range only have their multi-line comment state worked out,
+ * which is all that the rows in the range depend on.
+ *
+ * param start: Index of the first row in the range.
+ * param end: Index of the first row after the range.
+ */
+void editorPrepareRows(int start, int end) {
+    if (start < 0)
+        start = 0;
+    if (end > E.numRows)
+        end = E.numRows;
+
+    editorCollectHighlights();
+    while (E.hlValidRows < start)
+        editorSyntaxStep(0);
+
+    int j;
+    for (j = start; j < end; j++) {
+        erow *row = tsRow(&E.text, j);
+        if (j >= E.hlValidRows)
+            editorSyntaxStep(1);
+        if (row->flags & (ROW_RENDER_DIRTY | ROW_HL_DIRTY)) {
+            editorRenderRow(row);
+            editorUpdateSyntax(row, 1);
+        }
+    }
+}
+
+/**
+ * Keep a row's characters for a background save that is still writing
+ * them, to be freed once it is done.
+ *
+ * param chars: The characters.
+ */
+void editorRetireChars(char *chars) {
+    if (save.numRetired == save.retiredCap) {
+        save.retiredCap = save.retiredCap ? save.retiredCap * 2 : 64;
+        save.retired = realloc(save.retired, sizeof(char *) * save.retiredCap);
+        if (save.retired == NULL)
+            die("editorRetireChars: realloc");
+    }
+    save.retired[save.numRetired++] = chars;
+}
+
+/**
+ * Give a row its own copy of its characters so that it can be edited.
+ * Rows read from a memory mapped file point into the mapping until then,
+ * and rows being written by a background save keep their old buffer
+ * for it.
+ *
+ * param row: The line about to be edited.
+ */
+void editorRowMakeWritable(erow *row) {
+    if (!(row->flags & (ROW_MAPPED | ROW_SAVING)))
+        return;
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (row->flags & ROW_SAVING)
+        editorRetireChars(row->chars);
+    row->chars = chars;
+    row->flags &= ~(ROW_MAPPED | ROW_SAVING);
+}
+
+/**
+ * Insert a row that takes over an allocated string for its text rather
+ * than copying it.
+ *
+ * param at: The row index to insert at.
+ * param chars: Row of text, NUL terminated, allocated with malloc.
+ * param len: Length of the row.
+ */
+void editorAdoptRow(int at, char *chars, size_t len) {
+    if (at < 0 || at > E.numRows) {
+        free(chars);
+        return;
+    }
+
+    erow *row = tsInsert(&E.text, at);
+    E.numRows++;
+    if (E.hlDirtyEnd > at)
+        E.hlDirtyEnd++;
+
+    row->size = len;
+    row->chars = chars;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlOpenComment = 0;
+    row->flags = 0;
+    row->tabs = NULL;
+    row->numTabs = 0;
+    editorUpdateRow(row);
+
+    E.dirty++;
+}
+
+/**
+ * Allocate memory for a row of text.
+ *
+ * param at: The row index to insert at.
+ * param s: Row of text to add.
+ * param len: Length of the row.
+ */
+void editorInsertRow(int at, const char *s, size_t len) {
+    if (at < 0 || at > E.numRows)
+        return;
+
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    editorAdoptRow(at, chars, len);
+}
+
+/**
+ * Free the memory associated with storing and rendering a line.
+ *
+ * param row: The line to free.
+ */
+void editorFreeRow(erow *row) {
+    free(row->render);
+    if (row->flags & ROW_SAVING)
+        editorRetireChars(row->chars);
+    else if (!(row->flags & ROW_MAPPED))
+        free(row->chars);
+    free(row->hl);
+    free(row->tabs);
+}
+
+/**
+ * Delete a line of text.
+ *
+ * param at: The line the cursor is at.
+ */
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numRows)
+        return;
+    editorFreeRow(tsRow(&E.text, at));
+    tsDelete(&E.text, at);
+    E.numRows--;
+    if (at < E.hlValidRows)
+        E.hlValidRows = at;
+    if (E.hlDirtyEnd > at)
+        E.hlDirtyEnd--;
+    E.hlGen++;
+    E.dirty++;
+}
+
+/**
+ * Insert a single character into a line at the cursor.
  *
  * param row: The line of text.
  * param at: The index we want to insert the character at.
@@ -637,6 +1788,7 @@ void editorDelRow(int at) {
 void editorRowInsertChar(erow *row, int at, int c) {
     if (at < 0 || at > row->size)
         at = row->size;
+    editorRowMakeWritable(row);
     row->chars = realloc(row->chars, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
@@ -653,6 +1805,7 @@ void editorRowInsertChar(erow *row, int at, int c) {
  * param len: The length of the string.
  */
 void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowMakeWritable(row);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
@@ -670,6 +1823,7 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
 void editorRowDelChar(erow *row, int at) {
     if (at < 0 || at >= row->size)
         return;
+    editorRowMakeWritable(row);
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
     editorUpdateRow(row);
@@ -684,22 +1838,27 @@ void editorRowDelChar(erow *row, int at) {
  * param c: The character being inserted.
  */
 void editorInsertChar(int c) {
+    char ch = c;
+    editorUndoInsert(E.cy, E.cx, &ch, 1);
+    editorJournalInsert(E.cy, E.cx, &ch, 1);
     if (E.cy == E.numRows)
         editorInsertRow(E.numRows, "", 0);
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    editorRowInsertChar(tsRow(&E.text, E.cy), E.cx, c);
     E.cx++;
 }
 
 /**
- * Insert a new line.
+ * Break the line at the cursor, leaving the cursor at the start of the
+ * new line.
  */
-void editorInsertNewLine() {
+void editorBreakLine() {
     if (E.cx == 0) {
         editorInsertRow(E.cy, "", 0);
     } else {
-        erow *row = &E.row[E.cy];
+        erow *row = tsRow(&E.text, E.cy);
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
+        row = tsRow(&E.text, E.cy);
+        editorRowMakeWritable(row);
         row->size = E.cx;
         row->chars[row->size] = '\0';
         editorUpdateRow(row);
@@ -708,6 +1867,115 @@ void editorInsertNewLine() {
     E.cx = 0;
 }
 
+/**
+ * Insert a new line.
+ */
+void editorInsertNewLine() {
+    editorUndoInsert(E.cy, E.cx, "\n", 1);
+    editorJournalInsert(E.cy, E.cx, "\n", 1);
+    editorBreakLine();
+}
+
+/**
+ * Find the end of a line of text.
+ *
+ * param s: Start of the line.
+ * param end: End of the text.
+ * return: Pointer to the line break, or end if there is none.
+ */
+const char *editorLineEnd(const char *s, const char *end) {
+    while (s < end && *s != '\r' && *s != '\n')
+        s++;
+    return s;
+}
+
+/**
+ * Step over a line break.
+ *
+ * param s: Pointer to a line break.
+ * param end: End of the text.
+ * return: Pointer to the start of the next line.
+ */
+const char *editorSkipLineBreak(const char *s, const char *end) {
+    if (*s == '\r' && s + 1 < end && s[1] == '\n')
+        return s + 2;
+    return s + 1;
+}
+
+/**
+ * Insert text at the cursor's position, leaving the cursor after it. A
+ * carriage return, line feed or both together start a new line. The text
+ * is split into rows in one pass, each row is allocated once at its full
+ * size, and each affected row is marked for re-rendering once.
+ *
+ * param s: The text to insert.
+ * param len: Length of the text.
+ */
+void editorInsertText(const char *s, int len) {
+    const char *end = s + len;
+    editorUndoInsert(E.cy, E.cx, s, len);
+    editorJournalInsert(E.cy, E.cx, s, len);
+
+    /* Past the last row, line breaks only add rows. Text after them
+     * starts a row of its own. */
+    if (E.cy == E.numRows) {
+        while (s < end && (*s == '\r' || *s == '\n')) {
+            s = editorSkipLineBreak(s, end);
+            editorBreakLine();
+        }
+        if (s == end)
+            return;
+        editorInsertRow(E.numRows, "", 0);
+    }
+
+    /* The text after the last line break joins the rest of the row. */
+    const char *last = end;
+    while (last > s && last[-1] != '\r' && last[-1] != '\n')
+        last--;
+
+    erow *row = tsRow(&E.text, E.cy);
+    editorRowMakeWritable(row);
+    if (last == s) {
+        int n = end - s;
+        row->chars = realloc(row->chars, row->size + n + 1);
+        memmove(&row->chars[E.cx + n], &row->chars[E.cx],
+                row->size - E.cx + 1);
+        memcpy(&row->chars[E.cx], s, n);
+        row->size += n;
+        editorUpdateRow(row);
+        E.cx += n;
+        E.dirty++;
+        return;
+    }
+
+    int lastLen = end - last;
+    int restLen = row->size - E.cx;
+    char *lastRow = malloc(lastLen + restLen + 1);
+    memcpy(lastRow, last, lastLen);
+    memcpy(&lastRow[lastLen], &row->chars[E.cx], restLen);
+    lastRow[lastLen + restLen] = '\0';
+
+    const char *brk = editorLineEnd(s, end);
+    row->chars = realloc(row->chars, E.cx + (brk - s) + 1);
+    memcpy(&row->chars[E.cx], s, brk - s);
+    row->size = E.cx + (brk - s);
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+
+    int at = E.cy + 1;
+    s = editorSkipLineBreak(brk, end);
+    while (s < last) {
+        brk = editorLineEnd(s, end);
+        editorInsertRow(at++, s, brk - s);
+        s = editorSkipLineBreak(brk, end);
+    }
+    editorAdoptRow(at, lastRow, lastLen + restLen);
+
+    E.cy = at;
+    E.cx = lastLen;
+    E.dirty++;
+}
+
 /**
  * Prepare to delete a character from the cursor's position.
  */
@@ -717,583 +1985,4578 @@ void editorDelChar() {
     if (E.cx == 0 && E.cy == 0)
         return;
 
-    erow *row = &E.row[E.cy];
+    erow *row = tsRow(&E.text, E.cy);
     if (E.cx > 0) {
+        editorUndoDelete(E.cy, E.cx - 1, &row->chars[E.cx - 1], 1);
+        editorJournalDelete(E.cy, E.cx - 1, 1);
         editorRowDelChar(row, E.cx - 1);
         E.cx--;
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        erow *prev = tsRow(&E.text, E.cy - 1);
+        editorUndoDelete(E.cy - 1, prev->size, "\n", 1);
+        editorJournalDelete(E.cy - 1, prev->size, 1);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
-/*** file i/o ***/
-
 /**
- * Convert the file into a string that can be written to disk.
+ * Delete a span of text, counting the end of each row as one character.
+ * The rows in between are removed in one go, and the cursor is left where
+ * the span started. A span from the start of a row past the end of the
+ * last row removes that row too.
  *
- * param buflen: Length of the buffer that was written.
+ * param row: Row where the span starts.
+ * param col: Offset in the row's chars where the span starts.
+ * param len: Length of the span.
  */
-char *editorRowsToString(int *buflen){
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numRows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numRows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+void editorDeleteRange(int row, int col, int len) {
+    if (row < 0 || row >= E.numRows || len <= 0)
+        return;
+    editorJournalDelete(row, col, len);
+    erow *first = tsRow(&E.text, row);
+    if (col > first->size)
+        col = first->size;
+
+    /* Find the row and offset where the span ends. */
+    int last = row;
+    long long end = (long long)col + len;
+    while (last < E.numRows - 1 && end > tsRow(&E.text, last)->size) {
+        end -= tsRow(&E.text, last)->size + 1;
+        last++;
+    }
+    erow *lastRow = tsRow(&E.text, last);
+    int past = (end > lastRow->size);
+    if (past)
+        end = lastRow->size;
+
+    editorRowMakeWritable(first);
+    if (last == row) {
+        memmove(&first->chars[col], &first->chars[end], first->size - end + 1);
+        first->size -= end - col;
+        editorUpdateRow(first);
+        E.dirty++;
+    } else {
+        first->size = col;
+        first->chars[col] = '\0';
+        editorRowAppendString(first, &lastRow->chars[end],
+                              lastRow->size - end);
+        int j;
+        for (j = last; j > row; j--)
+            editorDelRow(j);
     }
+    if (past && col == 0)
+        editorDelRow(row);
+    E.cy = row;
+    E.cx = col;
+}
+
+/*** undo ***/
+
+/* An edit that can be undone. Records are kept back to back in the undo
+ * log, each followed by the text inserted or deleted, padded to a
+ * multiple of four bytes. prevSize is the size of the record before,
+ * so that the log can be walked backwards. op is 'i' for an insertion,
+ * 'a' for one past the last row, which adds the row it goes in, or 'd'
+ * for a deletion. sealed is set on an insertion that holds a line break,
+ * which typing never extends. */
+struct undoRecord {
+    int prevSize;
+    int op;
+    int row;
+    int col;
+    int len;
+    int sealed;
+};
 
-    return buf;
+#define UNDO_RECORD_SIZE(len) \
+    ((int)sizeof(struct undoRecord) + (((len) + 3) & ~3))
+
+/* The undo log. The records up to top can be undone, and the ones from
+ * there to end redone. topSize is the size of the record ending at top,
+ * which later typing or deleting in the same place extends while merge
+ * is set. The oldest records are dropped to keep the log under
+ * KILO_UNDO_LIMIT bytes. Edits are not recorded while applying is set. */
+struct undoLog {
+    char *buf;
+    int cap;
+    int top;
+    int end;
+    int topSize;
+    int merge;
+    int applying;
+};
+
+struct undoLog undo = {NULL, 0, 0, 0, 0, 0, 0};
+
+/**
+ * Forget everything that could be undone or redone.
+ */
+void editorUndoClear() {
+    free(undo.buf);
+    undo.buf = NULL;
+    undo.cap = 0;
+    undo.top = 0;
+    undo.end = 0;
+    undo.topSize = 0;
+    undo.merge = 0;
 }
 
 /**
- * Open and read a file from disk.
+ * Make room after top for a record, dropping the records that can be
+ * redone and, if the log would grow past KILO_UNDO_LIMIT, the oldest
+ * records that can be undone. Enough are dropped to bring the log down
+ * to three quarters of the limit, so that this happens rarely.
  *
- * param filename: Name of a file being opened and read.
+ * param need: Number of bytes needed.
+ * return: 0 on success, -1 if the record is too big to keep.
  */
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    editorSelectSyntaxHighlight();
+int editorUndoReserve(int need) {
+    undo.end = undo.top;
+    if (need > KILO_UNDO_LIMIT) {
+        editorUndoClear();
+        return -1;
+    }
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("editorOpen: fopen");
+    if (undo.top + need > KILO_UNDO_LIMIT) {
+        int drop = 0;
+        while (drop < undo.top &&
+               undo.top - drop + need > KILO_UNDO_LIMIT / 4 * 3) {
+            struct undoRecord *rec = (struct undoRecord *)&undo.buf[drop];
+            drop += UNDO_RECORD_SIZE(rec->len);
+        }
+        memmove(undo.buf, &undo.buf[drop], undo.top - drop);
+        undo.top -= drop;
+        undo.end = undo.top;
+        if (undo.top == 0) {
+            undo.topSize = 0;
+            undo.merge = 0;
+        } else {
+            ((struct undoRecord *)undo.buf)->prevSize = 0;
+        }
+    }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numRows, line, linelen);
+    if (undo.top + need > undo.cap) {
+        int cap = undo.cap ? undo.cap * 2 : 4096;
+        while (cap < undo.top + need)
+            cap *= 2;
+        if (cap > KILO_UNDO_LIMIT)
+            cap = KILO_UNDO_LIMIT;
+        undo.buf = realloc(undo.buf, cap);
+        if (undo.buf == NULL)
+            die("editorUndoReserve: realloc");
+        undo.cap = cap;
     }
-    free(line);
-    fclose(fp); 
-    E.dirty = 0;
+    return 0;
 }
 
 /**
- * Save the text to a file on the disk.
+ * Return the last record if later edits may still extend it.
+ *
+ * param op: The kind of edit about to be recorded.
+ * param row: Row where the edit starts.
+ * return: The record, or NULL.
  */
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
-    }
-
-    int len;
-    char *buf = editorRowsToString(&len);
+struct undoRecord *editorUndoLast(int op, int row) {
+    if (!undo.merge || undo.topSize == 0)
+        return NULL;
+    struct undoRecord *rec =
+        (struct undoRecord *)&undo.buf[undo.top - undo.topSize];
+    if ((rec->op != op && !(op == 'i' && rec->op == 'a')) || rec->row != row)
+        return NULL;
+    return rec;
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if(write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+/**
+ * Add a record after top. Room must have been made for it already. Line
+ * breaks in the text are stored as "\n", so that the record's length
+ * counts them the way editorDeleteRange() does.
+ *
+ * param op: 'i', 'a' or 'd'.
+ * param row: Row where the edit starts.
+ * param col: Offset in the row's chars where the edit starts.
+ * param s: The text inserted or deleted.
+ * param len: Length of the text.
+ */
+void editorUndoPush(int op, int row, int col, const char *s, int len) {
+    struct undoRecord *rec = (struct undoRecord *)&undo.buf[undo.top];
+    rec->prevSize = undo.topSize;
+    rec->op = op;
+    rec->row = row;
+    rec->col = col;
+    rec->sealed = 0;
+
+    char *text = (char *)(rec + 1);
+    const char *end = s + len;
+    len = 0;
+    while (s < end) {
+        const char *brk = editorLineEnd(s, end);
+        memcpy(&text[len], s, brk - s);
+        len += brk - s;
+        if (brk == end)
+            break;
+        text[len++] = '\n';
+        rec->sealed = 1;
+        s = editorSkipLineBreak(brk, end);
     }
+    rec->len = len;
+    undo.topSize = UNDO_RECORD_SIZE(len);
+    undo.top += undo.topSize;
+    undo.end = undo.top;
+    undo.merge = 1;
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+/**
+ * Make the last record longer to take in more text. Room must have been
+ * made for it already.
+ *
+ * param rec: The last record.
+ * param len: Number of bytes being added.
+ * return: Where the record's text starts.
+ */
+char *editorUndoGrow(struct undoRecord *rec, int len) {
+    int size = UNDO_RECORD_SIZE(rec->len + len);
+    rec->len += len;
+    undo.top += size - undo.topSize;
+    undo.end = undo.top;
+    undo.topSize = size;
+    return (char *)(rec + 1);
 }
 
-/*** find ***/
+/**
+ * Stop later edits from extending the last record, so that the next edit
+ * is undone on its own.
+ */
+void editorUndoBreak() {
+    undo.merge = 0;
+}
 
 /**
- * A callback function for incremental searching through the file.
+ * Record an insertion. Typing on from the end of the last insertion
+ * extends it until a new word starts, so that a run of typing is undone
+ * a word at a time.
  *
- * param query: The searching query.
- * param key: The keypress.
+ * param row: Row where the text goes.
+ * param col: Offset in the row's chars where the text goes.
+ * param s: The text.
+ * param len: Length of the text.
  */
-void editorFindCallback(char *query, int key) {
-    static int lastMatch = -1;
-    static int direction = 1;
-
-    static int savedHlLine;
-    static char *savedHl = NULL;
+void editorUndoInsert(int row, int col, const char *s, int len) {
+    if (undo.applying || len == 0 ||
+        editorUndoReserve(UNDO_RECORD_SIZE(len)) == -1)
+        return;
 
-    if (savedHl) {
-         memcpy(E.row[savedHlLine].hl, savedHl, E.row[savedHlLine].rsize);
-         free(savedHl);
-         savedHl = NULL;
+    struct undoRecord *rec = editorUndoLast('i', row);
+    if (rec && rec->col + rec->len == col &&
+        memchr(s, '\n', len) == NULL && memchr(s, '\r', len) == NULL) {
+        char *text = (char *)(rec + 1);
+        char prev = text[rec->len - 1];
+        if (!rec->sealed && !(isspace(prev) && !isspace(s[0]))) {
+            text = editorUndoGrow(rec, len);
+            memcpy(&text[rec->len - len], s, len);
+            return;
+        }
     }
+    editorUndoPush(row == E.numRows ? 'a' : 'i', row, col, s, len);
+}
 
-    if (key == '\r' || key == '\x1b') {
-        lastMatch = -1;
-        direction = 1;
+/**
+ * Record a deletion, before the text is deleted. Deleting backwards or
+ * forwards from the last deletion extends it.
+ *
+ * param row: Row where the deleted text starts.
+ * param col: Offset in the row's chars where the deleted text starts.
+ * param s: The text being deleted, with the end of a row as "\n".
+ * param len: Length of the text.
+ */
+void editorUndoDelete(int row, int col, const char *s, int len) {
+    if (undo.applying || len == 0 ||
+        editorUndoReserve(UNDO_RECORD_SIZE(len)) == -1)
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+
+    struct undoRecord *rec = editorUndoLast('d', row);
+    if (rec && col + len == rec->col) {
+        char *text = editorUndoGrow(rec, len);
+        memmove(&text[len], text, rec->len - len);
+        memcpy(text, s, len);
+        rec->col = col;
+    } else if (rec && col == rec->col) {
+        char *text = editorUndoGrow(rec, len);
+        memcpy(&text[rec->len - len], s, len);
     } else {
-        lastMatch = -1;
-        direction = 1;
+        editorUndoPush('d', row, col, s, len);
     }
-    
-    if (lastMatch == -1)
-        direction = 1;
-    int current = lastMatch;
-    int i;
-    for (i = 0; i < E.numRows; i++) {
-        current += direction;
-        if (current == -1)
-            current = E.numRows - 1;
-        else if (current == E.numRows)
-            current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            lastMatch = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowOff = E.numRows;
-
-            savedHlLine = current;
-            savedHl = malloc(row->rsize);
-            memcpy(savedHl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+}
+
+/**
+ * Apply a record, or its opposite. Either way it is one edit however
+ * much text the record holds.
+ *
+ * param rec: The record.
+ * param reverse: Whether to undo the edit rather than redo it.
+ */
+void editorUndoApply(struct undoRecord *rec, int reverse) {
+    undo.applying = 1;
+    if ((rec->op != 'd') != reverse) {
+        E.cy = rec->row;
+        E.cx = rec->col;
+        editorInsertText((char *)(rec + 1), rec->len);
+    } else {
+        editorDeleteRange(rec->row, rec->col, rec->len + (rec->op == 'a'));
     }
+    undo.applying = 0;
+    undo.merge = 0;
 }
 
 /**
- * Prompt the user for a string and search through the text.
+ * Undo the last edit.
  */
-void editorFind() {
-    int savedCx = E.cx;
-    int savedCy = E.cy;
-    int savedColOff = E.colOff;
-    int savedRowOff = E.rowOff;
+void editorUndo() {
+    if (undo.top == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoRecord *rec =
+        (struct undoRecord *)&undo.buf[undo.top - undo.topSize];
+    editorUndoApply(rec, 1);
+    undo.top -= undo.topSize;
+    undo.topSize = rec->prevSize;
+}
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                               editorFindCallback);
+/**
+ * Redo the last edit undone.
+ */
+void editorRedo() {
+    if (undo.top == undo.end) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    struct undoRecord *rec = (struct undoRecord *)&undo.buf[undo.top];
+    editorUndoApply(rec, 0);
+    undo.topSize = UNDO_RECORD_SIZE(rec->len);
+    undo.top += undo.topSize;
+}
 
-    if (query) {
-        free(query);
+/*** file i/o ***/
+
+/**
+ * Check whether some text is part of the memory mapped file.
+ *
+ * param p: The text.
+ */
+int editorInMap(const char *p) {
+    return p >= E.map && p < E.map + E.mapLen;
+}
+
+/**
+ * Add a piece of the file to the save snapshot, joining it onto the last
+ * piece if the two are next to each other in memory and both or neither
+ * are in the mapped file.
+ *
+ * param base: Start of the piece.
+ * param len: Length of the piece.
+ */
+void editorIovAppend(char *base, size_t len) {
+    if (len == 0)
+        return;
+    if (save.numIov > 0) {
+        struct iovec *last = &save.iov[save.numIov - 1];
+        if ((char *)last->iov_base + last->iov_len == base &&
+            editorInMap(last->iov_base) == editorInMap(base)) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (save.numIov == save.iovCap) {
+        save.iovCap = save.iovCap ? save.iovCap * 2 : 1024;
+        save.iov = realloc(save.iov, sizeof(struct iovec) * save.iovCap);
+        if (save.iov == NULL)
+            die("editorIovAppend: realloc");
+    }
+    save.iov[save.numIov].iov_base = base;
+    save.iov[save.numIov].iov_len = len;
+    save.numIov++;
+}
+
+/**
+ * Take a snapshot of the text for a save. Nothing is copied: the snapshot
+ * points at the rows' own buffers, each followed by a newline. A run of
+ * rows that are still mapped from the file they were read from is one
+ * piece of memory, newlines and all, so it takes a single iovec. Other
+ * rows are flagged so that edits leave their buffers alone.
+ */
+void editorSaveSnapshot() {
+    save.numIov = 0;
+    save.total = 0;
+    int j;
+    for (j = 0; j < E.numRows; j++) {
+        erow *row = tsRow(&E.text, j);
+        char *nl = "\n";
+        if (!(row->flags & ROW_MAPPED))
+            row->flags |= ROW_SAVING;
+        else if (row->chars + row->size < E.map + E.mapLen &&
+                 row->chars[row->size] == '\n')
+            nl = &row->chars[row->size];
+        editorIovAppend(row->chars, row->size);
+        editorIovAppend(nl, 1);
+        save.total += row->size + 1;
+    }
+    save.dirty = E.dirty;
+    save.journalPos = editorJournalMark();
+}
+
+/**
+ * Write a batch of iovecs in full, carrying on after short writes.
+ *
+ * param fd: The file to write to.
+ * param iov: The batch, which is used up as it is written.
+ * param cnt: Number of iovecs in the batch.
+ * return: 0 on success, -1 on error.
+ */
+int editorWriteIov(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pass the progress of a save back to the main loop.
+ *
+ * param written: Number of bytes written so far.
+ */
+void editorSaveProgress(off_t written) {
+    pthread_mutex_lock(&save.lock);
+    save.written = written;
+    pthread_mutex_unlock(&save.lock);
+    write(wakePipe[1], "s", 1);
+}
+
+/**
+ * Copy part of the file that was opened straight to another file inside
+ * the kernel, which can share the blocks on file systems that support
+ * it. This stops early if the kernel cannot copy between the two files.
+ *
+ * param fd: The file to write to.
+ * param base: Start of the part, in the mapping.
+ * param len: Length of the part.
+ * param written: Bytes written so far, added to as the copy goes.
+ * return: Number of bytes copied, or -1 on error.
+ */
+ssize_t editorCopyMapped(int fd, char *base, size_t len, off_t *written) {
+    off_t in = base - E.map;
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done;
+        if (n > KILO_SAVE_CHUNK)
+            n = KILO_SAVE_CHUNK;
+        ssize_t r = copy_file_range(E.mapFd, &in, fd, NULL, n, 0);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && done == 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+             errno == EOPNOTSUPP || errno == EBADF))
+            break;
+        if (r == -1)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+        *written += r;
+        editorSaveProgress(*written);
+    }
+    return done;
+}
+
+/**
+ * Write the save snapshot to a file. Pieces of the file as it was opened
+ * are copied by the kernel from the open file, so an edit costs time in
+ * proportion to what was changed. Pieces under KILO_SAVE_COPY_MIN are
+ * not worth a system call of their own. Everything else, and everything if
+ * the kernel cannot copy, is written with writev() in batches of at most
+ * KILO_SAVE_IOVECS iovecs and KILO_SAVE_CHUNK bytes. Progress is passed
+ * back to the main loop after each batch.
+ *
+ * param fd: The file to write to.
+ * return: Number of bytes written, or -1 on error.
+ */
+off_t editorWriteSnapshot(int fd) {
+    struct iovec batch[KILO_SAVE_IOVECS];
+    int cnt = 0;
+    size_t bytes = 0;
+    off_t written = 0;
+    int copy = (E.mapFd != -1);
+    int j;
+    for (j = 0; j < save.numIov; j++) {
+        char *base = save.iov[j].iov_base;
+        size_t len = save.iov[j].iov_len;
+
+        if (copy && len >= KILO_SAVE_COPY_MIN && editorInMap(base)) {
+            if (editorWriteIov(fd, batch, cnt) == -1)
+                return -1;
+            written += bytes;
+            cnt = 0;
+            bytes = 0;
+
+            ssize_t n = editorCopyMapped(fd, base, len, &written);
+            if (n == -1)
+                return -1;
+            if ((size_t)n < len)
+                copy = 0;
+            base += n;
+            len -= n;
+        }
+
+        while (len > 0) {
+            size_t n = len;
+            if (n > KILO_SAVE_CHUNK - bytes)
+                n = KILO_SAVE_CHUNK - bytes;
+            batch[cnt].iov_base = base;
+            batch[cnt].iov_len = n;
+            cnt++;
+            bytes += n;
+            base += n;
+            len -= n;
+            if (cnt == KILO_SAVE_IOVECS || bytes == KILO_SAVE_CHUNK) {
+                if (editorWriteIov(fd, batch, cnt) == -1)
+                    return -1;
+                written += bytes;
+                cnt = 0;
+                bytes = 0;
+                editorSaveProgress(written);
+            }
+        }
+    }
+    if (editorWriteIov(fd, batch, cnt) == -1)
+        return -1;
+    return written + bytes;
+}
+
+/**
+ * Flush a directory entry for a file to disk, so that a rename into the
+ * directory survives a crash. Errors are ignored, as some file systems
+ * cannot sync directories.
+ *
+ * param filename: The file.
+ */
+void editorSyncDir(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    char *dir = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+    if (dir == NULL)
+        die("editorSyncDir: strdup");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/**
+ * Write the save snapshot to a file without ever leaving it half written.
+ * The text goes to a temporary file in the same directory, which is
+ * flushed to disk and then renamed over the file. A file that is a
+ * symbolic link has its target replaced, and an existing file keeps its
+ * permissions.
+ *
+ * param filename: The file.
+ * return: Number of bytes written, or -1 with errno set on error.
+ */
+off_t editorSaveFile(const char *filename) {
+    char *path = realpath(filename, NULL);
+    if (path == NULL && (path = strdup(filename)) == NULL)
+        die("editorSaveFile: strdup");
+
+    mode_t mode;
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
     } else {
-        E.cx = savedCx;
-        E.cy = savedCy;
-        E.colOff = savedColOff;
-        E.rowOff = savedRowOff;
+        mode = 0644 & ~E.umask;
+    }
+
+    char *tmp = malloc(strlen(path) + 8);
+    if (tmp == NULL)
+        die("editorSaveFile: malloc");
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    off_t len = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        if (fchmod(fd, mode) != -1 && (len = editorWriteSnapshot(fd)) != -1 &&
+            fsync(fd) == -1)
+            len = -1;
+        int err = errno;
+        if (close(fd) == -1 && len != -1) {
+            err = errno;
+            len = -1;
+        }
+        if (len != -1 && rename(tmp, path) == -1) {
+            err = errno;
+            len = -1;
+        }
+        if (len == -1)
+            unlink(tmp);
+        else
+            editorSyncDir(path);
+        errno = err;
     }
+
+    free(tmp);
+    free(path);
+    return len;
 }
 
-/*** append buffer ***/
+/**
+ * Main function of the background saving thread.
+ *
+ * param arg: Unused.
+ */
+void *editorSaveWorker(void *arg) {
+    (void)arg;
+    off_t len = editorSaveFile(save.filename);
+    int err = errno;
+
+    pthread_mutex_lock(&save.lock);
+    save.result = len;
+    save.err = err;
+    save.done = 1;
+    pthread_mutex_unlock(&save.lock);
+    write(wakePipe[1], "s", 1);
+    return NULL;
+}
 
-struct abuf{
-    char *b;
-    int len;
-};
+/**
+ * Check on a background save, showing its progress, and tidy up after it
+ * once it is over. Edits made while it was running still count as
+ * unsaved afterwards. While a prompt is showing, the save is left until
+ * the prompt is over, so that its messages do not replace the prompt.
+ *
+ * param wait: Whether to wait for the save to finish.
+ * return: 1 if the screen needs to be redrawn, 0 if not.
+ */
+int editorCollectSave(int wait) {
+    if (!save.running)
+        return 0;
+    if (E.prompting && !wait) {
+        save.deferred = 1;
+        return 0;
+    }
+    save.deferred = 0;
+
+    pthread_mutex_lock(&save.lock);
+    int done = save.done;
+    off_t written = save.written;
+    pthread_mutex_unlock(&save.lock);
+    if (!done && !wait) {
+        editorSetStatusMessage("Saving %.20s... %d%%", save.filename,
+                               (int)(save.total ? written * 100 / save.total :
+                                     100));
+        return 1;
+    }
 
-#define ABUF_INIT {NULL, 0}
+    if (!pthread_equal(save.thread, pthread_self()))
+        pthread_join(save.thread, NULL);
+    save.running = 0;
+
+    int j;
+    for (j = 0; j < E.numRows; j++)
+        tsRow(&E.text, j)->flags &= ~ROW_SAVING;
+    for (j = 0; j < save.numRetired; j++)
+        free(save.retired[j]);
+    save.numRetired = 0;
+
+    if (save.result == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s",
+                               strerror(save.err));
+    } else {
+        E.dirty = E.dirty > save.dirty ? E.dirty - save.dirty : 0;
+        editorJournalSaved(save.journalPos);
+        editorSetStatusMessage("%lld bytes written to disk",
+                               (long long)save.result);
+    }
+    free(save.filename);
+    save.filename = NULL;
+    return 1;
+}
 
 /**
- * Append a string onto the end of an existing dynamic string.
+ * Split a memory mapped file into rows. The rows point straight into the
+ * mapping, and are neither copied nor rendered until they are needed.
  *
- * param ab: The dynamic string to append to.
- * param s: The string being appended.
- * param len: Length of the string being appended.
+ * param map: Start of the mapping.
+ * param len: Length of the mapping.
+ * return: 0 on success, or -1 if a line is too long for a row.
  */
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+int editorOpenMapped(char *map, size_t len) {
+    char *p = map;
+    char *end = map + len;
+
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        size_t linelen = (nl ? nl : end) - p;
+        while (linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        if (linelen > INT_MAX)
+            return -1;
 
-    if (new == NULL)
+        erow *row = tsInsert(&E.text, E.numRows++);
+        row->size = linelen;
+        row->rsize = 0;
+        row->chars = p;
+        row->render = NULL;
+        row->hl = NULL;
+        row->hlOpenComment = 0;
+        row->tabs = NULL;
+        row->numTabs = 0;
+        row->flags = ROW_MAPPED | ROW_RENDER_DIRTY | ROW_HL_DIRTY |
+                     ROW_STATE_DIRTY;
+
+        p = nl ? nl + 1 : end;
+    }
+    E.hlDirtyEnd = E.numRows;
+    return 0;
+}
+
+/**
+ * Give up on opening a file with a line too long for a row. The rows read
+ * so far are dropped, and the file is forgotten so that saving cannot
+ * overwrite it with them.
+ *
+ * param filename: Name of the file.
+ */
+void editorOpenTooLong(const char *filename) {
+    editorSetStatusMessage("Can't open %.20s: it has a line longer than %d "
+                           "bytes", filename, INT_MAX);
+    while (E.numRows > 0)
+        editorDelRow(E.numRows - 1);
+    free(E.filename);
+    E.filename = NULL;
+    E.syntax = NULL;
+    E.dirty = 0;
+}
+
+/**
+ * Open and read a file from disk. Regular files are memory mapped rather
+ * than read so that opening them costs the same regardless of size.
+ *
+ * param filename: Name of a file being opened and read.
+ */
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("editorOpen: open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("editorOpen: fstat");
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            /* The file stays open so that saves can copy from it. */
+            E.mapFd = fd;
+            E.map = map;
+            E.mapLen = st.st_size;
+            if (editorOpenMapped(map, st.st_size) == -1) {
+                editorOpenTooLong(filename);
+                munmap(map, st.st_size);
+                close(fd);
+                E.mapFd = -1;
+                E.map = NULL;
+                E.mapLen = 0;
+                return;
+            }
+            E.dirty = 0;
+            return;
+        }
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if (!fp)
+        die("editorOpen: fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+        if (linelen > INT_MAX) {
+            editorOpenTooLong(filename);
+            break;
+        }
+        editorInsertRow(E.numRows, line, linelen);
+    }
+    free(line);
+    fclose(fp); 
+    E.dirty = 0;
+}
+
+/**
+ * Save the text to a file on the disk. The text is written by a
+ * background thread from a snapshot, so editing can carry on meanwhile.
+ */
+void editorSave() {
+    if (save.running) {
+        editorSetStatusMessage("Already saving, please wait");
         return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    editorSaveSnapshot();
+    save.filename = strdup(E.filename);
+    if (save.filename == NULL)
+        die("editorSave: strdup");
+    save.written = 0;
+    save.done = 0;
+    save.running = 1;
+    if (pthread_create(&save.thread, NULL, editorSaveWorker, NULL) != 0) {
+        save.thread = pthread_self();
+        editorSaveWorker(NULL);
+    }
+    editorCollectSave(0);
 }
 
+/*** regex ***/
+
+/* Parsing state while a pattern is compiled. */
+struct reParser {
+    const char *p;
+    const char *end;
+    int ignoreCase;
+    int reverse;
+    struct reProg *prog;
+    const char *err;
+};
+
+/* A piece of NFA with one way in and a list of loose ends. A loose end is
+ * the out (slot state * 2) or out1 (slot state * 2 + 1) field of a state,
+ * and the list is threaded through those fields, ending with -1. */
+struct reFrag {
+    int start;
+    int outs;
+};
+
 /**
- * Free a dynamic string.
+ * Add a state to an NFA.
  *
- * param ab: A dynamic string to free.
+ * param prog: The NFA.
+ * param op: What the state does.
+ * param out: The state to move to next.
+ * param out1: The other state to move to, for RE_SPLIT.
+ * return: Index of the new state.
  */
-void abFree(struct abuf *ab) {
-    free(ab->b);
+int reAddState(struct reProg *prog, int op, int out, int out1) {
+    if (prog->numStates == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 16;
+        prog->states = realloc(prog->states, sizeof(struct reState) * prog->cap);
+        if (prog->states == NULL)
+            die("reAddState: realloc");
+    }
+    struct reState *st = &prog->states[prog->numStates];
+    st->op = op;
+    st->out = out;
+    st->out1 = out1;
+    memset(st->cls, 0, sizeof(st->cls));
+    return prog->numStates++;
 }
 
-/*** output ***/
+/**
+ * Find the field a loose end refers to.
+ *
+ * param prog: The NFA.
+ * param slot: The loose end.
+ */
+int *reSlot(struct reProg *prog, int slot) {
+    struct reState *st = &prog->states[slot / 2];
+    return (slot & 1) ? &st->out1 : &st->out;
+}
 
 /**
- * Check if the cursor has moved outside of the visible window. If so,
- * adjust the cursor so that it is in the visible window.
+ * Point every loose end in a list at a state.
+ *
+ * param prog: The NFA.
+ * param list: The loose ends.
+ * param target: The state they should lead to.
  */
-void editorScroll() {
-    E.rx = 0;
-    if (E.cy < E.numRows)
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+void rePatch(struct reProg *prog, int list, int target) {
+    while (list != -1) {
+        int *field = reSlot(prog, list);
+        list = *field;
+        *field = target;
+    }
+}
 
-    if (E.cy < E.rowOff)
-        E.rowOff = E.cy;
-    if (E.cy >= E.rowOff + E.screenRows)
-        E.rowOff = E.cy - E.screenRows + 1;
-    if (E.rx < E.colOff)
-        E.colOff = E.rx;
-    if (E.rx >= E.colOff + E.screenCols)
-        E.colOff = E.rx - E.screenCols + 1;
+/**
+ * Join two lists of loose ends.
+ *
+ * param prog: The NFA.
+ * param a: The first list.
+ * param b: The second list.
+ * return: The joined list.
+ */
+int reAppend(struct reProg *prog, int a, int b) {
+    if (a == -1)
+        return b;
+    int list = a;
+    while (*reSlot(prog, list) != -1)
+        list = *reSlot(prog, list);
+    *reSlot(prog, list) = b;
+    return a;
+}
+
+/**
+ * Add the other case of every letter in a set of bytes.
+ *
+ * param cls: The set of bytes, one bit each.
+ */
+void reFoldCase(unsigned char *cls) {
+    int j;
+    for (j = 'a'; j <= 'z'; j++) {
+        int u = toupper(j);
+        if ((cls[j >> 3] & (1 << (j & 7))) || (cls[u >> 3] & (1 << (u & 7)))) {
+            cls[j >> 3] |= 1 << (j & 7);
+            cls[u >> 3] |= 1 << (u & 7);
+        }
+    }
+}
+
+/**
+ * Make a fragment that consumes one byte from a set.
+ *
+ * param p: The parser.
+ * param cls: The set of bytes, one bit each.
+ */
+struct reFrag reByteSet(struct reParser *p, const unsigned char *cls) {
+    int s = reAddState(p->prog, RE_CLASS, -1, -1);
+    memcpy(p->prog->states[s].cls, cls, 32);
+    if (p->ignoreCase)
+        reFoldCase(p->prog->states[s].cls);
+    struct reFrag f = {s, s * 2};
+    return f;
+}
+
+/**
+ * Add the bytes matched by an escape such as \d to a set. Any other
+ * escaped character stands for itself.
+ *
+ * param cls: The set of bytes.
+ * param c: The character after the backslash.
+ */
+void reEscapeSet(unsigned char *cls, int c) {
+    int negate = isupper(c) && strchr("DWS", c);
+    int j;
+    for (j = 0; j < 256; j++) {
+        int in;
+        switch (tolower(c)) {
+            case 'd': in = isdigit(j); break;
+            case 'w': in = isalnum(j) || j == '_'; break;
+            case 's': in = isspace(j); break;
+            default: in = (j == c); negate = 0; break;
+        }
+        if (!in != !negate)
+            cls[j >> 3] |= 1 << (j & 7);
+    }
 }
 
+struct reFrag reParseAlt(struct reParser *p);
+
+/**
+ * Parse a bracket expression such as [a-z_] or [^0-9], with the opening
+ * bracket already taken.
+ *
+ * param p: The parser.
+ */
+struct reFrag reParseClass(struct reParser *p) {
+    unsigned char cls[32];
+    memset(cls, 0, sizeof(cls));
+    int negate = 0;
+    if (p->p < p->end && *p->p == '^') {
+        negate = 1;
+        p->p++;
+    }
+
+    int first = 1;
+    while (p->p < p->end && (*p->p != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*p->p++;
+        if (lo == '\\') {
+            if (p->p == p->end)
+                break;
+            lo = (unsigned char)*p->p++;
+            if (strchr("dwsDWS", lo)) {
+                reEscapeSet(cls, lo);
+                continue;
+            }
+        }
+        int hi = lo;
+        if (p->p + 1 < p->end && *p->p == '-' && p->p[1] != ']') {
+            p->p++;
+            hi = (unsigned char)*p->p++;
+            if (hi == '\\' && p->p < p->end)
+                hi = (unsigned char)*p->p++;
+            if (hi < lo) {
+                p->err = "bad range";
+                return (struct reFrag){-1, -1};
+            }
+        }
+        int j;
+        for (j = lo; j <= hi; j++)
+            cls[j >> 3] |= 1 << (j & 7);
+    }
+    if (p->p == p->end) {
+        p->err = "missing ]";
+        return (struct reFrag){-1, -1};
+    }
+    p->p++;
+
+    /* [^a] has to leave out A as well when case is ignored. */
+    if (p->ignoreCase)
+        reFoldCase(cls);
+    if (negate) {
+        int j;
+        for (j = 0; j < 32; j++)
+            cls[j] = ~cls[j];
+    }
+    return reByteSet(p, cls);
+}
+
+/**
+ * Parse a single character, bracket expression or group.
+ *
+ * param p: The parser.
+ */
+struct reFrag reParseAtom(struct reParser *p) {
+    unsigned char cls[32];
+    memset(cls, 0, sizeof(cls));
+
+    int c = (unsigned char)*p->p++;
+    switch (c) {
+        case '(': {
+            struct reFrag f = reParseAlt(p);
+            if (p->err)
+                return f;
+            if (p->p == p->end || *p->p != ')') {
+                p->err = "missing )";
+                return f;
+            }
+            p->p++;
+            return f;
+        }
+        case '[':
+            return reParseClass(p);
+        case '.':
+            memset(cls, 0xff, sizeof(cls));
+            return reByteSet(p, cls);
+        case '*':
+        case '+':
+        case '?':
+            p->err = "nothing to repeat";
+            return (struct reFrag){-1, -1};
+        case '\\':
+            if (p->p == p->end) {
+                p->err = "trailing \\";
+                return (struct reFrag){-1, -1};
+            }
+            reEscapeSet(cls, (unsigned char)*p->p++);
+            return reByteSet(p, cls);
+        case '^':
+        case '$': {
+            int s = reAddState(p->prog, c == '^' ? RE_BOL : RE_EOL, -1, -1);
+            return (struct reFrag){s, s * 2};
+        }
+        default:
+            cls[c >> 3] |= 1 << (c & 7);
+            return reByteSet(p, cls);
+    }
+}
+
+/**
+ * Parse an atom followed by any number of *, + and ? operators.
+ *
+ * param p: The parser.
+ */
+struct reFrag reParseRepeat(struct reParser *p) {
+    struct reFrag f = reParseAtom(p);
+    while (!p->err && p->p < p->end && strchr("*+?", *p->p)) {
+        int s = reAddState(p->prog, RE_SPLIT, f.start, -1);
+        switch (*p->p++) {
+            case '*':
+                rePatch(p->prog, f.outs, s);
+                f.start = s;
+                f.outs = s * 2 + 1;
+                break;
+            case '+':
+                rePatch(p->prog, f.outs, s);
+                f.outs = s * 2 + 1;
+                break;
+            case '?':
+                f.start = s;
+                f.outs = reAppend(p->prog, f.outs, s * 2 + 1);
+                break;
+        }
+    }
+    return f;
+}
+
+/**
+ * Parse a sequence of repeated atoms. When the pattern is being compiled
+ * backwards, the pieces are joined in the opposite order.
+ *
+ * param p: The parser.
+ */
+struct reFrag reParseConcat(struct reParser *p) {
+    int s = reAddState(p->prog, RE_EMPTY, -1, -1);
+    struct reFrag f = {s, s * 2};
+    while (!p->err && p->p < p->end && *p->p != '|' && *p->p != ')') {
+        struct reFrag g = reParseRepeat(p);
+        if (p->err)
+            break;
+        if (p->reverse) {
+            rePatch(p->prog, g.outs, f.start);
+            f.start = g.start;
+        } else {
+            rePatch(p->prog, f.outs, g.start);
+            f.outs = g.outs;
+        }
+    }
+    return f;
+}
+
+/**
+ * Parse alternatives separated by |.
+ *
+ * param p: The parser.
+ */
+struct reFrag reParseAlt(struct reParser *p) {
+    struct reFrag f = reParseConcat(p);
+    while (!p->err && p->p < p->end && *p->p == '|') {
+        p->p++;
+        struct reFrag g = reParseConcat(p);
+        if (p->err)
+            break;
+        int s = reAddState(p->prog, RE_SPLIT, f.start, g.start);
+        f.start = s;
+        f.outs = reAppend(p->prog, f.outs, g.outs);
+    }
+    return f;
+}
+
+/**
+ * Free a compiled pattern.
+ *
+ * param re: The pattern, or NULL.
+ */
+void reFree(struct regex *re) {
+    if (re == NULL)
+        return;
+    free(re->fwd.states);
+    free(re->rev.states);
+    free(re);
+}
+
+/**
+ * Compile a pattern. Patterns support literal characters, ., bracket
+ * expressions, the escapes \d, \w and \s and their negations, grouping,
+ * |, *, + and ?, and ^ and $, which match at the start and end of the
+ * line wherever they appear, as they do in POSIX extended patterns.
+ *
+ * param pattern: The pattern.
+ * param ignoreCase: Whether letters should match either case.
+ * param err: Set to a description of the problem if compiling fails.
+ * return: The compiled pattern, or NULL on failure.
+ */
+struct regex *reCompile(const char *pattern, int ignoreCase, const char **err) {
+    struct regex *re = calloc(1, sizeof(*re));
+    if (re == NULL)
+        die("reCompile: calloc");
+
+    int len = strlen(pattern);
+    int reverse;
+    for (reverse = 0; reverse < 2; reverse++) {
+        struct reParser p;
+        p.p = pattern;
+        p.end = pattern + len;
+        p.ignoreCase = ignoreCase;
+        p.reverse = reverse;
+        p.prog = reverse ? &re->rev : &re->fwd;
+        p.err = NULL;
+
+        struct reFrag f = reParseAlt(&p);
+        if (!p.err && p.p < p.end)
+            p.err = "unmatched )";
+        if (p.err) {
+            *err = p.err;
+            reFree(re);
+            return NULL;
+        }
+        rePatch(p.prog, f.outs, reAddState(p.prog, RE_MATCH, -1, -1));
+        p.prog->start = f.start;
+    }
+    return re;
+}
+
+/**
+ * Set up a DFA for an NFA. No states are built until they are needed.
+ *
+ * param d: The DFA.
+ * param prog: The NFA.
+ * param unanchored: Whether a match may start at any byte.
+ */
+void reDfaInit(struct reDfa *d, struct reProg *prog, int unanchored) {
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->states = malloc(sizeof(*d->states) * KILO_RE_MAX_STATES);
+    d->numStates = 0;
+    d->trans = NULL;
+    d->transCap = 0;
+    d->table = calloc(KILO_RE_MAX_STATES * 2, sizeof(int));
+    d->start = -1;
+    d->work = malloc(sizeof(int) * (prog->numStates + 1));
+    d->stack = malloc(sizeof(int) * (prog->numStates * 2 + 2));
+    d->mark = calloc(prog->numStates, sizeof(int));
+    d->gen = 0;
+    if (d->states == NULL || d->table == NULL || d->work == NULL ||
+        d->stack == NULL || d->mark == NULL)
+        die("reDfaInit: malloc");
+}
+
+/**
+ * Throw away every state a DFA has built.
+ *
+ * param d: The DFA.
+ */
+void reDfaFlush(struct reDfa *d) {
+    int j;
+    for (j = 0; j < d->numStates; j++) {
+        free(d->states[j]->set);
+        free(d->states[j]);
+    }
+    d->numStates = 0;
+    if (d->trans)
+        memset(d->trans, 0xff, sizeof(int) * 256 * d->transCap);
+    memset(d->table, 0, sizeof(int) * KILO_RE_MAX_STATES * 2);
+    d->start = -1;
+}
+
+/**
+ * Free a DFA.
+ *
+ * param d: The DFA.
+ */
+void reDfaFree(struct reDfa *d) {
+    reDfaFlush(d);
+    free(d->states);
+    free(d->trans);
+    free(d->table);
+    free(d->work);
+    free(d->stack);
+    free(d->mark);
+}
+
+/**
+ * Add an NFA state to the set being built in d->work, along with every
+ * state it leads to without consuming a byte. Only states that consume a
+ * byte, accept, or wait for an end of the line that has not been reached
+ * are kept in the set.
+ *
+ * param d: The DFA.
+ * param s: The NFA state.
+ * param n: Number of states in d->work, updated as states are added.
+ * param edges: RE_AT_BOL and RE_AT_EOL for the ends of the line the
+ *              position is at.
+ */
+void reDfaAddState(struct reDfa *d, int s, int *n, int edges) {
+    int top = 0;
+    d->stack[top++] = s;
+    while (top > 0) {
+        s = d->stack[--top];
+        if (s < 0 || d->mark[s] == d->gen)
+            continue;
+        d->mark[s] = d->gen;
+        struct reState *st = &d->prog->states[s];
+        switch (st->op) {
+            case RE_SPLIT:
+                d->stack[top++] = st->out1;
+                d->stack[top++] = st->out;
+                break;
+            case RE_EMPTY:
+                d->stack[top++] = st->out;
+                break;
+            case RE_BOL:
+            case RE_EOL:
+                if (edges & (st->op == RE_BOL ? RE_AT_BOL : RE_AT_EOL))
+                    d->stack[top++] = st->out;
+                else
+                    d->work[(*n)++] = s;
+                break;
+            default:
+                d->work[(*n)++] = s;
+                break;
+        }
+    }
+}
+
+/**
+ * Compare two NFA state numbers, for qsort().
+ */
+int reCompareInts(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Find or build the DFA state for the set of NFA states in d->work.
+ *
+ * param d: The DFA.
+ * param n: Number of states in the set.
+ * return: Index of the DFA state, or -1 if no more states can be built.
+ */
+int reDfaLookup(struct reDfa *d, int n) {
+    qsort(d->work, n, sizeof(int), reCompareInts);
+
+    unsigned int h = 2166136261u;
+    int j;
+    for (j = 0; j < n; j++)
+        h = (h ^ (unsigned int)d->work[j]) * 16777619u;
+
+    int mask = KILO_RE_MAX_STATES * 2 - 1;
+    int slot = h & mask;
+    while (d->table[slot]) {
+        struct reDfaState *st = d->states[d->table[slot] - 1];
+        if (st->n == n && memcmp(st->set, d->work, sizeof(int) * n) == 0)
+            return d->table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+    if (d->numStates == KILO_RE_MAX_STATES)
+        return -1;
+    if (d->numStates == d->transCap) {
+        int cap = d->transCap ? d->transCap * 2 : 16;
+        d->trans = realloc(d->trans, sizeof(int) * 256 * cap);
+        if (d->trans == NULL)
+            die("reDfaLookup: realloc");
+        memset(&d->trans[256 * d->transCap], 0xff,
+               sizeof(int) * 256 * (cap - d->transCap));
+        d->transCap = cap;
+    }
+
+    struct reDfaState *st = malloc(sizeof(*st));
+    st->set = malloc(sizeof(int) * (n ? n : 1));
+    if (st == NULL || st->set == NULL)
+        die("reDfaLookup: malloc");
+    memcpy(st->set, d->work, sizeof(int) * n);
+    st->n = n;
+    st->match = 0;
+    memset(st->edge, 0xff, sizeof(st->edge));
+    for (j = 0; j < n; j++)
+        if (d->prog->states[d->work[j]].op == RE_MATCH)
+            st->match = 1;
+
+    d->states[d->numStates] = st;
+    d->table[slot] = ++d->numStates;
+    return d->numStates - 1;
+}
+
+/**
+ * Find or build a DFA's start state.
+ *
+ * param d: The DFA.
+ * return: Index of the start state.
+ */
+int reDfaStart(struct reDfa *d) {
+    if (d->start != -1)
+        return d->start;
+    int n = 0;
+    d->gen++;
+    reDfaAddState(d, d->prog->start, &n, 0);
+    d->start = reDfaLookup(d, n);
+    if (d->start == -1) {
+        reDfaFlush(d);
+        d->start = reDfaLookup(d, n);
+    }
+    return d->start;
+}
+
+/**
+ * Work out where a DFA moves on a byte it has not yet seen in a state,
+ * building the next state if it has not been needed before. If the DFA
+ * is full, every other state is thrown away, so indices from before the
+ * call must not be used after it.
+ *
+ * param d: The DFA.
+ * param cur: The current state.
+ * param c: The byte.
+ * return: The move, packed as in the DFA's table.
+ */
+int reDfaNext(struct reDfa *d, int cur, unsigned char c) {
+    struct reDfaState *from = d->states[cur];
+    int n = 0;
+    int j;
+    d->gen++;
+    for (j = 0; j < from->n; j++) {
+        struct reState *st = &d->prog->states[from->set[j]];
+        if (st->op == RE_CLASS && (st->cls[c >> 3] & (1 << (c & 7))))
+            reDfaAddState(d, st->out, &n, 0);
+    }
+    if (d->unanchored)
+        reDfaAddState(d, d->prog->start, &n, 0);
+
+    int next = reDfaLookup(d, n);
+    int keep = 1;
+    if (next == -1) {
+        reDfaFlush(d);
+        next = reDfaLookup(d, n);
+        keep = 0;
+    }
+
+    struct reDfaState *to = d->states[next];
+    int move = (next << 2) | (to->match ? RE_MATCHED : 0) |
+               ((to->n == 0 && !d->unanchored) ? RE_DEAD : 0);
+    if (keep)
+        d->trans[cur * 256 + c] = move;
+    return move;
+}
+
+/**
+ * Work out the state a DFA is in once it reaches an end of the line,
+ * where the RE_BOL or RE_EOL states in its set can move on. Like
+ * reDfaNext(), this may throw every other state away.
+ *
+ * param d: The DFA.
+ * param cur: The current state.
+ * param edges: RE_AT_BOL and RE_AT_EOL for the ends of the line reached.
+ * return: Index of the state.
+ */
+int reDfaEdge(struct reDfa *d, int cur, int edges) {
+    struct reDfaState *from = d->states[cur];
+    if (from->edge[edges] != -1)
+        return from->edge[edges];
+    int n = 0;
+    int j;
+    d->gen++;
+    for (j = 0; j < from->n; j++)
+        reDfaAddState(d, from->set[j], &n, edges);
+
+    int next = reDfaLookup(d, n);
+    if (next == -1) {
+        reDfaFlush(d);
+        return reDfaLookup(d, n);
+    }
+    from->edge[edges] = next;
+    return next;
+}
+
+/**
+ * Set up the DFAs for running a pattern on one thread.
+ *
+ * param m: The matcher.
+ * param re: The compiled pattern.
+ */
+void reMatcherInit(struct reMatcher *m, struct regex *re) {
+    m->re = re;
+    reDfaInit(&m->fwd, &re->fwd, 0);
+    reDfaInit(&m->rev, &re->rev, 1);
+    m->starts = NULL;
+    m->ends = NULL;
+    m->startsCap = 0;
+    int n = re->rev.numStates;
+    m->threads[0] = malloc(sizeof(int) * n);
+    m->threads[1] = malloc(sizeof(int) * n);
+    m->threadEnds[0] = malloc(sizeof(int) * n);
+    m->threadEnds[1] = malloc(sizeof(int) * n);
+    m->stack = malloc(sizeof(int) * (n * 2 + 2));
+    m->mark = calloc(n, sizeof(int));
+    m->gen = 0;
+    if (m->threads[0] == NULL || m->threads[1] == NULL ||
+        m->threadEnds[0] == NULL || m->threadEnds[1] == NULL ||
+        m->stack == NULL || m->mark == NULL)
+        die("reMatcherInit: malloc");
+}
+
+/**
+ * Free a matcher's DFAs. The pattern itself is left alone.
+ *
+ * param m: The matcher.
+ */
+void reMatcherFree(struct reMatcher *m) {
+    reDfaFree(&m->fwd);
+    reDfaFree(&m->rev);
+    free(m->starts);
+    free(m->ends);
+    free(m->threads[0]);
+    free(m->threads[1]);
+    free(m->threadEnds[0]);
+    free(m->threadEnds[1]);
+    free(m->stack);
+    free(m->mark);
+}
+
+/**
+ * Mark every position in a line where a match starts, by running the
+ * reversed pattern backwards from the end of the line in one pass.
+ *
+ * param m: The matcher.
+ * param s: The line.
+ * param len: Length of the line.
+ */
+void reMarkStarts(struct reMatcher *m, const char *s, int len) {
+    if (m->startsCap < len + 1) {
+        m->startsCap = len + 1;
+        free(m->starts);
+        free(m->ends);
+        m->starts = malloc(m->startsCap);
+        m->ends = malloc(sizeof(int) * m->startsCap);
+        if (m->starts == NULL || m->ends == NULL)
+            die("reMarkStarts: malloc");
+    }
+    memset(m->starts, 0, len + 1);
+
+    struct reDfa *d = &m->rev;
+    int st = reDfaEdge(d, reDfaStart(d), RE_AT_EOL | (len ? 0 : RE_AT_BOL));
+    m->starts[len] = d->states[st]->match;
+    int p;
+    for (p = len - 1; p >= 0; p--) {
+        int move = d->trans[st * 256 + (unsigned char)s[p]];
+        if (move == -1)
+            move = reDfaNext(d, st, s[p]);
+        if (move & RE_DEAD)
+            break;
+        st = move >> 2;
+        m->starts[p] = (move & RE_MATCHED) ||
+                       (p == 0 && d->states[reDfaEdge(d, st, RE_AT_BOL)]->match);
+    }
+}
+
+/**
+ * Find the longest match starting at a position in a line, giving up once
+ * a number of bytes have been read. The DFA has to read on until it dies,
+ * which can be far past the end of the match, so without a limit finding
+ * every match in a line could take time in proportion to the square of
+ * its length.
+ *
+ * param m: The matcher.
+ * param s: The line.
+ * param len: Length of the line.
+ * param at: Where the match has to start.
+ * param budget: Number of bytes that may be read, reduced by the number
+ *               read.
+ * return: Where the match ends, -1 if there is no match, or -2 if the
+ *         budget ran out first.
+ */
+int reMatchAt(struct reMatcher *m, const char *s, int len, int at,
+              int *budget) {
+    struct reDfa *d = &m->fwd;
+    int st = reDfaStart(d);
+    int edges = (at == 0 ? RE_AT_BOL : 0) | (at == len ? RE_AT_EOL : 0);
+    if (edges)
+        st = reDfaEdge(d, st, edges);
+    int best = d->states[st]->match ? at : -1;
+    int p;
+    for (p = at; p < len; p++) {
+        if ((*budget)-- == 0)
+            return -2;
+        int move = d->trans[st * 256 + (unsigned char)s[p]];
+        if (move == -1)
+            move = reDfaNext(d, st, s[p]);
+        if (move & RE_DEAD)
+            break;
+        st = move >> 2;
+        if ((move & RE_MATCHED) ||
+            (p + 1 == len && d->states[reDfaEdge(d, st, RE_AT_EOL)]->match))
+            best = p + 1;
+    }
+    return best;
+}
+
+/**
+ * Add a thread to a list, along with every thread it leads to without
+ * consuming a byte. States already on the list this step are left as
+ * they are, so the first thread to reach a state wins.
+ *
+ * param m: The matcher.
+ * param list: Which of the two thread lists to add to.
+ * param s: The state of the reversed NFA.
+ * param end: Where the thread's match ends.
+ * param n: Number of threads on the list, updated as threads are added.
+ * param edges: RE_AT_BOL and RE_AT_EOL for the ends of the line the
+ *              position is at.
+ */
+void reAddThread(struct reMatcher *m, int list, int s, int end, int *n,
+                 int edges) {
+    struct reProg *prog = &m->re->rev;
+    int top = 0;
+    m->stack[top++] = s;
+    while (top > 0) {
+        s = m->stack[--top];
+        if (s < 0 || m->mark[s] == m->gen)
+            continue;
+        m->mark[s] = m->gen;
+        struct reState *st = &prog->states[s];
+        switch (st->op) {
+            case RE_SPLIT:
+                m->stack[top++] = st->out1;
+                m->stack[top++] = st->out;
+                break;
+            case RE_EMPTY:
+                m->stack[top++] = st->out;
+                break;
+            case RE_BOL:
+            case RE_EOL:
+                if (edges & (st->op == RE_BOL ? RE_AT_BOL : RE_AT_EOL))
+                    m->stack[top++] = st->out;
+                break;
+            default:
+                m->threads[list][*n] = s;
+                m->threadEnds[list][*n] = end;
+                (*n)++;
+                break;
+        }
+    }
+}
+
+/**
+ * Work out where the longest match from each place in a line ends, in a
+ * single pass backwards from the end of the line to a given place. The
+ * reversed NFA is run with a new thread started at every byte, and each
+ * thread remembers where its match ends. The threads are kept in order of
+ * that end, latest first, so when two of them reach the same state only
+ * the one with the longer match is kept. This is slower per byte than the
+ * DFA, but takes time in proportion to the length of the line whatever
+ * the pattern.
+ *
+ * param m: The matcher, with m->ends large enough for the line.
+ * param s: The line.
+ * param len: Length of the line.
+ * param from: The first place to work out.
+ */
+void reLongestEnds(struct reMatcher *m, const char *s, int len, int from) {
+    struct reProg *prog = &m->re->rev;
+    int cur = 0;
+    int n = 0;
+    m->gen++;
+    reAddThread(m, cur, prog->start, len, &n,
+                RE_AT_EOL | (len ? 0 : RE_AT_BOL));
+
+    int p;
+    for (p = len; p >= from; p--) {
+        m->ends[p] = -1;
+        int k;
+        for (k = 0; k < n; k++) {
+            if (prog->states[m->threads[cur][k]].op == RE_MATCH) {
+                m->ends[p] = m->threadEnds[cur][k];
+                break;
+            }
+        }
+        if (p == from)
+            break;
+
+        unsigned char c = s[p - 1];
+        int edges = (p == 1 ? RE_AT_BOL : 0);
+        int prev = n;
+        n = 0;
+        m->gen++;
+        for (k = 0; k < prev; k++) {
+            struct reState *st = &prog->states[m->threads[cur][k]];
+            if (st->op == RE_CLASS && (st->cls[c >> 3] & (1 << (c & 7))))
+                reAddThread(m, !cur, st->out, m->threadEnds[cur][k], &n,
+                            edges);
+        }
+        reAddThread(m, !cur, prog->start, p - 1, &n, edges);
+        cur = !cur;
+    }
+}
+
+/*** find ***/
+
+/**
+ * Find the first occurrence of a query in some text. Case-sensitive
+ * searches use memmem(). Otherwise the text is scanned with memchr() for
+ * either case of the query's first character and only those places are
+ * compared in full.
+ *
+ * param s: The text to search.
+ * param len: Length of the text.
+ * param q: The query.
+ * param qlen: Length of the query.
+ * param ignoreCase: Whether letters of either case match.
+ * return: Offset of the match, or -1 if there is none.
+ */
+int editorSearchText(const char *s, int len, const char *q, int qlen,
+                     int ignoreCase) {
+    if (qlen == 0)
+        return 0;
+    if (qlen > len)
+        return -1;
+    if (!ignoreCase) {
+        const char *m = memmem(s, len, q, qlen);
+        return m ? m - s : -1;
+    }
+
+    int lower = tolower((unsigned char)q[0]);
+    int upper = toupper((unsigned char)q[0]);
+    const char *end = s + len - qlen + 1;
+    const char *nextLower = NULL;
+    const char *nextUpper = (lower == upper) ? end : NULL;
+    const char *p = s;
+    while (p < end) {
+        if (nextLower == NULL || nextLower < p) {
+            nextLower = memchr(p, lower, end - p);
+            if (nextLower == NULL)
+                nextLower = end;
+        }
+        if (nextUpper == NULL || nextUpper < p) {
+            nextUpper = memchr(p, upper, end - p);
+            if (nextUpper == NULL)
+                nextUpper = end;
+        }
+        if (nextLower == p || nextUpper == p) {
+            if (strncasecmp(p + 1, q + 1, qlen - 1) == 0)
+                return p - s;
+            p++;
+        } else {
+            p = nextLower < nextUpper ? nextLower : nextUpper;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check whether a match for the search sits on word boundaries.
+ *
+ * param row: The row holding the match.
+ * param at: Offset of the match in the row's chars.
+ * param len: Length of the match.
+ * return: 1 if it does, 0 if not.
+ */
+int editorSearchIsWord(erow *row, int at, int len) {
+    int end = at + len;
+    return (at == 0 || isSeparator(row->chars[at - 1])) &&
+           (end == row->size || isSeparator(row->chars[end]));
+}
+
+/**
+ * Add a match to a list, growing it as needed.
+ *
+ * param list: The list.
+ * param len: Number of matches in the list.
+ * param cap: Number of matches the list has room for.
+ * param row: Row of the match.
+ * param offset: Offset of the match in the row's chars.
+ * param matchLen: Length of the match.
+ */
+void editorSearchAdd(struct searchMatch **list, long long *len,
+                     long long *cap, int row, int offset, int matchLen) {
+    if (*len == *cap) {
+        if (*cap > (long long)(SIZE_MAX / sizeof(**list) / 2)) {
+            errno = ENOMEM;
+            die("editorSearchAdd");
+        }
+        *cap = *cap ? *cap * 2 : 64;
+        *list = realloc(*list, sizeof(**list) * *cap);
+        if (*list == NULL)
+            die("editorSearchAdd: realloc");
+    }
+    (*list)[*len].row = row;
+    (*list)[*len].offset = offset;
+    (*list)[*len].len = matchLen;
+    (*len)++;
+}
+
+/**
+ * Find every match for a pattern in a range of rows. Each line is
+ * scanned once backwards to mark where matches start, and the longest
+ * match is then taken from each of those places in turn by the forward
+ * DFA. If that reads more than KILO_RE_SCAN_FACTOR times the length of
+ * the line, the ends of the rest of the matches are all worked out in
+ * one more pass instead.
+ *
+ * param job: The search job to run.
+ */
+void editorSearchRegex(struct searchJob *job) {
+    struct reMatcher m;
+    reMatcherInit(&m, search.re);
+    int j;
+    for (j = job->start; j < job->end; j++) {
+        erow *row = tsRow(&E.text, j);
+        reMarkStarts(&m, row->chars, row->size);
+        int budget = KILO_RE_SCAN_FACTOR * (row->size + 1);
+        int longest = 0;
+        int at = 0;
+        while (at <= row->size) {
+            char *next = memchr(&m.starts[at], 1, row->size + 1 - at);
+            if (next == NULL)
+                break;
+            at = next - (char *)m.starts;
+            /* Empty matches are not worth stopping at. */
+            int end;
+            if (!longest &&
+                (end = reMatchAt(&m, row->chars, row->size, at,
+                                 &budget)) == -2) {
+                reLongestEnds(&m, row->chars, row->size, at);
+                longest = 1;
+            }
+            if (longest)
+                end = m.ends[at];
+            if (end <= at) {
+                at++;
+                continue;
+            }
+            /* A match that is not a whole word may still overlap one
+             * that starts after it. */
+            if ((search.flags & SEARCH_WHOLE_WORD) &&
+                !editorSearchIsWord(row, at, end - at)) {
+                at++;
+                continue;
+            }
+            editorSearchAdd(&job->matches, &job->numMatches, &job->cap,
+                            j, at, end - at);
+            at = end;
+        }
+    }
+    reMatcherFree(&m);
+}
+
+/**
+ * Find every match for the search in a range of rows. This runs on a
+ * separate thread while the main thread waits, so the rows do not
+ * change underneath it.
+ *
+ * param arg: The search job to run.
+ */
+void *editorSearchWorker(void *arg) {
+    struct searchJob *job = arg;
+    if (search.re) {
+        editorSearchRegex(job);
+        return NULL;
+    }
+
+    int ignoreCase = search.flags & SEARCH_IGNORE_CASE;
+    int j;
+    for (j = job->start; j < job->end; j++) {
+        erow *row = tsRow(&E.text, j);
+        int from = 0;
+        while (1) {
+            int at = editorSearchText(&row->chars[from], row->size - from,
+                                      search.query, search.queryLen,
+                                      ignoreCase);
+            if (at == -1)
+                break;
+            at += from;
+            if (!(search.flags & SEARCH_WHOLE_WORD) ||
+                editorSearchIsWord(row, at, search.queryLen))
+                editorSearchAdd(&job->matches, &job->numMatches, &job->cap,
+                                j, at, search.queryLen);
+            from = at + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find every match for the search in the file. Large files are split
+ * into ranges of rows that are searched on one thread per online CPU,
+ * and the results are joined in order.
+ */
+void editorSearchAll() {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > E.numRows / KILO_SEARCH_JOB_ROWS)
+        jobs = E.numRows / KILO_SEARCH_JOB_ROWS;
+    if (jobs > KILO_HL_MAX_THREADS)
+        jobs = KILO_HL_MAX_THREADS;
+    if (jobs < 1)
+        jobs = 1;
+
+    struct searchJob job[KILO_HL_MAX_THREADS];
+    int j;
+    for (j = 0; j < jobs; j++) {
+        job[j].start = (long long)E.numRows * j / jobs;
+        job[j].end = (long long)E.numRows * (j + 1) / jobs;
+        job[j].matches = NULL;
+        job[j].numMatches = 0;
+        job[j].cap = 0;
+        job[j].threaded = 0;
+    }
+    /* The first range is searched on this thread. */
+    for (j = 1; j < jobs; j++) {
+        job[j].threaded = (pthread_create(&job[j].thread, NULL,
+                                          editorSearchWorker, &job[j]) == 0);
+        if (!job[j].threaded)
+            editorSearchWorker(&job[j]);
+    }
+    editorSearchWorker(&job[0]);
+
+    long long total = 0;
+    for (j = 0; j < jobs; j++) {
+        if (job[j].threaded)
+            pthread_join(job[j].thread, NULL);
+        total += job[j].numMatches;
+    }
+    if (total > search.cap) {
+        search.matches = realloc(search.matches,
+                                 sizeof(struct searchMatch) * total);
+        if (search.matches == NULL)
+            die("editorSearchAll: realloc");
+        search.cap = total;
+    }
+
+    /* Each range's matches are in order already, so they are copied over
+     * a block at a time. */
+    search.numMatches = 0;
+    for (j = 0; j < jobs; j++) {
+        memcpy(&search.matches[search.numMatches], job[j].matches,
+               sizeof(struct searchMatch) * job[j].numMatches);
+        search.numMatches += job[j].numMatches;
+        free(job[j].matches);
+    }
+}
+
+/**
+ * Bring the match index up to date with a query. If the query is the
+ * previous one with more characters added, it can only match where the
+ * previous one did, so only those places are checked again. Otherwise
+ * the whole file is searched. In regex mode the query is compiled first,
+ * and a pattern that does not compile has no matches.
+ *
+ * param query: The query.
+ */
+void editorSearchUpdate(const char *query) {
+    int len = strlen(query);
+    if (search.query && len == search.queryLen &&
+        search.matchFlags == search.flags && strcmp(query, search.query) == 0)
+        return;
+
+    /* A whole word match for the longer query need not be one for the
+     * shorter, and a longer pattern can match anywhere, so those cases are
+     * searched afresh. */
+    int grown = (search.query && search.queryLen > 0 &&
+                 len > search.queryLen && search.matchFlags == search.flags &&
+                 !(search.flags & (SEARCH_WHOLE_WORD | SEARCH_REGEX)) &&
+                 strncmp(query, search.query, search.queryLen) == 0);
+
+    free(search.query);
+    search.query = strdup(query);
+    search.queryLen = len;
+    search.matchFlags = search.flags;
+    search.current = -1;
+    search.spanBottom = -1;
+    reFree(search.re);
+    search.re = NULL;
+    search.error = NULL;
+
+    if (len > 0 && (search.flags & SEARCH_REGEX)) {
+        search.re = reCompile(query, search.flags & SEARCH_IGNORE_CASE,
+                              &search.error);
+        if (search.re == NULL)
+            len = 0;
+    }
+
+    if (len == 0) {
+        search.numMatches = 0;
+    } else if (grown) {
+        int ignoreCase = search.flags & SEARCH_IGNORE_CASE;
+        long long kept = 0;
+        long long j;
+        for (j = 0; j < search.numMatches; j++) {
+            struct searchMatch *m = &search.matches[j];
+            erow *row = tsRow(&E.text, m->row);
+            if (m->offset + len <= row->size &&
+                (ignoreCase ?
+                    strncasecmp(&row->chars[m->offset], query, len) :
+                    memcmp(&row->chars[m->offset], query, len)) == 0) {
+                m->len = len;
+                search.matches[kept++] = *m;
+            }
+        }
+        search.numMatches = kept;
+    } else {
+        editorSearchAll();
+    }
+}
+
+/**
+ * Forget the search once the prompt is closed.
+ */
+void editorSearchEnd() {
+    free(search.query);
+    search.query = NULL;
+    search.queryLen = 0;
+    reFree(search.re);
+    search.re = NULL;
+    search.error = NULL;
+    search.numMatches = 0;
+    search.current = -1;
+    search.spanBottom = -1;
+    search.active = 0;
+}
+
+/**
+ * Find the first match that is not before a position in the file.
+ *
+ * param row: Row of the position.
+ * param offset: Offset of the position in the row's chars.
+ * return: Index into search.matches, which is search.numMatches if every
+ *         match is before the position.
+ */
+long long editorSearchFirst(int row, int offset) {
+    long long lo = 0;
+    long long hi = search.numMatches;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        struct searchMatch *m = &search.matches[mid];
+        if (m->row < row || (m->row == row && m->offset < offset))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Work out where the matches in a range of rows are drawn, unless that
+ * is already known.
+ *
+ * param top: The first row.
+ * param bottom: The row after the last.
+ */
+void editorSearchSpans(int top, int bottom) {
+    if (top == search.spanTop && bottom == search.spanBottom)
+        return;
+    search.spanTop = top;
+    search.spanBottom = bottom;
+    search.numSpans = 0;
+
+    long long j;
+    for (j = editorSearchFirst(top, 0);
+         j < search.numMatches && search.matches[j].row < bottom; j++) {
+        struct searchMatch *m = &search.matches[j];
+        if (search.numSpans == search.spanCap) {
+            search.spanCap = search.spanCap ? search.spanCap * 2 : 64;
+            search.spans = realloc(search.spans,
+                                   sizeof(struct searchSpan) * search.spanCap);
+            if (search.spans == NULL)
+                die("editorSearchSpans: realloc");
+        }
+        erow *row = tsRow(&E.text, m->row);
+        struct searchSpan *span = &search.spans[search.numSpans++];
+        span->row = m->row;
+        span->rx = editorRowCxToRx(row, m->offset);
+        span->rxEnd = editorRowCxToRx(row, m->offset + m->len);
+        span->match = j;
+    }
+}
+
+/**
+ * Find the match after or before a position in the file, wrapping around
+ * the ends of the file.
+ *
+ * param row: Row of the position.
+ * param offset: Offset of the position in the row's chars.
+ * param direction: 1 to look forwards, -1 to look backwards.
+ * return: Index into search.matches, or -1 if there are no matches.
+ */
+long long editorSearchNext(int row, int offset, int direction) {
+    if (search.numMatches == 0)
+        return -1;
+
+    long long lo = editorSearchFirst(row, offset);
+    if (direction == 1) {
+        if (lo < search.numMatches && search.matches[lo].row == row &&
+            search.matches[lo].offset == offset)
+            lo++;
+        return lo < search.numMatches ? lo : 0;
+    }
+    return lo > 0 ? lo - 1 : search.numMatches - 1;
+}
+
+/**
+ * A callback function for incremental searching through the file.
+ *
+ * param query: The searching query.
+ * param key: The keypress.
+ */
+void editorFindCallback(char *query, int key) {
+    if (key == '\r' || key == '\x1b') {
+        return;
+    } else if (key == CTRL_KEY('c')) {
+        search.flags ^= SEARCH_IGNORE_CASE;
+    } else if (key == CTRL_KEY('w')) {
+        search.flags ^= SEARCH_WHOLE_WORD;
+    } else if (key == CTRL_KEY('r')) {
+        search.flags ^= SEARCH_REGEX;
+    }
+
+    editorSearchUpdate(query);
+    if (search.numMatches == 0)
+        return;
+
+    if (search.current == -1) {
+        /* A new query starts from the top of the file. */
+        search.current = 0;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        search.current = editorSearchNext(E.cy, E.cx, 1);
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        search.current = editorSearchNext(E.cy, E.cx, -1);
+    }
+
+    struct searchMatch *m = &search.matches[search.current];
+    E.cy = m->row;
+    E.cx = m->offset;
+    E.rowOff = E.numRows;
+}
+
+/**
+ * Prompt the user for a string and search through the text.
+ */
+void editorFind() {
+    int savedCx = E.cx;
+    int savedCy = E.cy;
+    int savedColOff = E.colOff;
+    int savedRowOff = E.rowOff;
+
+    search.active = 1;
+    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter, "
+                               "^C case, ^W word, ^R regex)",
+                               editorFindCallback);
+    editorSearchEnd();
+
+    if (query) {
+        free(query);
+    } else {
+        E.cx = savedCx;
+        E.cy = savedCy;
+        E.colOff = savedColOff;
+        E.rowOff = savedRowOff;
+    }
+}
+
+/*** append buffer ***/
+
+struct abuf{
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/* Output for a frame is built here. The buffer is kept between frames, so
+ * once it has grown to fit a frame, drawing does not touch the heap. */
+struct abuf frame = ABUF_INIT;
+
+/**
+ * Make sure a dynamic string has room for more characters, growing it
+ * geometrically so that appending is cheap on average.
+ *
+ * param ab: The dynamic string to grow.
+ * param len: Number of characters about to be appended.
+ * return: 0 on success, -1 if there was no memory.
+ */
+int abReserve(struct abuf *ab, int len) {
+    if (ab->len + len <= ab->cap)
+        return 0;
+
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+        cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+        return -1;
+    ab->b = new;
+    ab->cap = cap;
+    return 0;
+}
+
+/**
+ * Append a string onto the end of an existing dynamic string.
+ *
+ * param ab: The dynamic string to append to.
+ * param s: The string being appended.
+ * param len: Length of the string being appended.
+ */
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (abReserve(ab, len) == -1)
+        return;
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+/**
+ * Append a single character onto the end of a dynamic string.
+ *
+ * param ab: The dynamic string to append to.
+ * param c: The character being appended.
+ */
+void abAppendByte(struct abuf *ab, char c) {
+    if (ab->len == ab->cap && abReserve(ab, 1) == -1)
+        return;
+    ab->b[ab->len++] = c;
+}
+
+/**
+ * Append a non-negative number in decimal onto the end of a dynamic
+ * string.
+ *
+ * param ab: The dynamic string to append to.
+ * param n: The number being appended.
+ */
+void abAppendNum(struct abuf *ab, int n) {
+    char buf[16];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    abAppend(ab, &buf[i], sizeof(buf) - i);
+}
+
+/**
+ * Append a number as a varint: seven bits to a byte, lowest first, with
+ * the top bit set on every byte but the last.
+ *
+ * param ab: The dynamic string to append to.
+ * param n: The number being appended.
+ */
+void abAppendVarint(struct abuf *ab, unsigned long long n) {
+    while (n >= 0x80) {
+        abAppendByte(ab, (n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    abAppendByte(ab, n);
+}
+
+/**
+ * Append an escape sequence that sets a single graphic rendition.
+ *
+ * param ab: The dynamic string to append to.
+ * param code: The SGR parameter, e.g. a colour.
+ */
+void abAppendSGR(struct abuf *ab, int code) {
+    abAppend(ab, "\x1b[", 2);
+    abAppendNum(ab, code);
+    abAppendByte(ab, 'm');
+}
+
+/**
+ * Append an escape sequence that moves the cursor.
+ *
+ * param ab: The dynamic string to append to.
+ * param y: Screen row, counting from 0.
+ * param x: Screen column, counting from 0.
+ */
+void abAppendMoveTo(struct abuf *ab, int y, int x) {
+    abAppend(ab, "\x1b[", 2);
+    abAppendNum(ab, y + 1);
+    abAppendByte(ab, ';');
+    abAppendNum(ab, x + 1);
+    abAppendByte(ab, 'H');
+}
+
+/**
+ * Empty a dynamic string but keep its memory for reuse.
+ *
+ * param ab: The dynamic string to empty.
+ */
+void abReset(struct abuf *ab) {
+    ab->len = 0;
+}
+
+/**
+ * Free a dynamic string.
+ *
+ * param ab: A dynamic string to free.
+ */
+void abFree(struct abuf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+/*** journal ***/
+
+/* The edits made since the file was last saved, appended to a journal
+ * file next to it so that they can be recovered after a crash. The file
+ * starts with a header identifying the version of the file the edits
+ * apply to, followed by records: an 'i' or 'd' for an insertion or
+ * deletion, then the row, column and length as varints, then the text
+ * of an insertion. Records collect in pending and are written and synced
+ * at most every KILO_JOURNAL_INTERVAL milliseconds, by which time due
+ * has passed. While typing or deleting carries on in one place, the last
+ * record in pending is extended rather than a new one added: it starts
+ * at last, its length byte is at lenAt, and lastOp, lastRow, lastCol and
+ * lastLen describe it. */
+struct journal {
+    int fd;
+    char *path;
+    off_t size;
+    int headerLen;
+    struct abuf pending;
+    long long due;
+    int failed;
+    int replaying;
+    int last;
+    int lenAt;
+    int lastOp;
+    int lastRow;
+    int lastCol;
+    int lastLen;
+};
+
+struct journal journal = {-1, NULL, 0, 0, ABUF_INIT, 0, 0, 0, -1, 0, 0, 0,
+                          0, 0};
+
+/**
+ * Work out the name of the journal for a file, which is a hidden file in
+ * the same directory.
+ *
+ * param filename: The file.
+ * return: The journal's name, allocated with malloc.
+ */
+char *editorJournalPath(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    const char *base = slash ? slash + 1 : filename;
+    char *path = malloc(strlen(filename) + 10);
+    if (path == NULL)
+        die("editorJournalPath: malloc");
+    sprintf(path, "%.*s.%s.journal", (int)(base - filename), filename, base);
+    return path;
+}
+
+/**
+ * Append a journal header for the file as it is on disk now: its size,
+ * modification time and inode.
+ *
+ * param ab: The dynamic string to append to.
+ * param filename: The file.
+ */
+void editorJournalHeader(struct abuf *ab, const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        memset(&st, 0, sizeof(st));
+    abAppend(ab, KILO_JOURNAL_MAGIC, strlen(KILO_JOURNAL_MAGIC));
+    abAppendVarint(ab, st.st_size);
+    abAppendVarint(ab, st.st_mtim.tv_sec);
+    abAppendVarint(ab, st.st_mtim.tv_nsec);
+    abAppendVarint(ab, st.st_ino);
+}
+
+/**
+ * Get ready to add a record to the journal, creating the journal if this
+ * is the first edit since the file was saved.
+ *
+ * return: 1 if the edit should be recorded, 0 if not.
+ */
+int editorJournalStart() {
+    /* A headless editor is only ever benchmarked, and must not replace
+     * the journal of a file being edited for real. */
+    if (journal.replaying || journal.failed || E.headless ||
+        E.filename == NULL)
+        return 0;
+    if (journal.fd == -1) {
+        journal.path = editorJournalPath(E.filename);
+        journal.fd = open(journal.path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                          0600);
+        if (journal.fd == -1) {
+            journal.failed = 1;
+            editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+            free(journal.path);
+            journal.path = NULL;
+            return 0;
+        }
+        journal.size = 0;
+        abReset(&journal.pending);
+        editorJournalHeader(&journal.pending, E.filename);
+        journal.headerLen = journal.pending.len;
+        journal.last = -1;
+    }
+    if (journal.due == 0)
+        journal.due = editorNow() + KILO_JOURNAL_INTERVAL;
+    return 1;
+}
+
+/**
+ * Add a record to the journal.
+ *
+ * param op: 'i' for an insertion or 'd' for a deletion.
+ * param row: Row where the edit starts.
+ * param col: Offset in the row's chars where the edit starts.
+ * param len: Length of the edit.
+ */
+void editorJournalRecord(int op, int row, int col, int len) {
+    journal.last = journal.pending.len;
+    abAppendByte(&journal.pending, op);
+    abAppendVarint(&journal.pending, row);
+    abAppendVarint(&journal.pending, col);
+    journal.lenAt = journal.pending.len;
+    abAppendVarint(&journal.pending, len);
+    journal.lastOp = op;
+    journal.lastRow = row;
+    journal.lastCol = col;
+    journal.lastLen = len;
+}
+
+/**
+ * Record an insertion in the journal. Text typed straight after the last
+ * insertion on the same line is added to it, as long as its length still
+ * fits in one byte.
+ *
+ * param row: Row where the text goes.
+ * param col: Offset in the row's chars where the text goes.
+ * param s: The text.
+ * param len: Length of the text.
+ */
+void editorJournalInsert(int row, int col, const char *s, int len) {
+    if (len == 0 || !editorJournalStart())
+        return;
+    int plain = (memchr(s, '\n', len) == NULL && memchr(s, '\r', len) == NULL);
+    if (plain && journal.last != -1 && journal.lastOp == 'i' &&
+        journal.lastRow == row && journal.lastCol + journal.lastLen == col &&
+        journal.lastLen + len < 0x80 &&
+        memchr(&journal.pending.b[journal.lenAt + 1], '\n',
+               journal.lastLen) == NULL &&
+        memchr(&journal.pending.b[journal.lenAt + 1], '\r',
+               journal.lastLen) == NULL) {
+        journal.lastLen += len;
+        journal.pending.b[journal.lenAt] = journal.lastLen;
+    } else {
+        editorJournalRecord('i', row, col, len);
+    }
+    abAppend(&journal.pending, s, len);
+}
+
+/**
+ * Record a deletion in the journal. Deleting backwards or forwards from
+ * the last deletion extends it.
+ *
+ * param row: Row where the deleted text starts.
+ * param col: Offset in the row's chars where the deleted text starts.
+ * param len: Length of the deleted text, counting the end of a row as
+ *            one character.
+ */
+void editorJournalDelete(int row, int col, int len) {
+    if (len == 0 || !editorJournalStart())
+        return;
+    if (journal.last != -1 && journal.lastOp == 'd' &&
+        journal.lastRow == row &&
+        (col + len == journal.lastCol || col == journal.lastCol)) {
+        journal.pending.len = journal.last;
+        editorJournalRecord('d', row, col, journal.lastLen + len);
+    } else {
+        editorJournalRecord('d', row, col, len);
+    }
+}
+
+/**
+ * Write the records made since the last flush to the journal and sync
+ * it to disk.
+ *
+ * param force: Whether to flush before KILO_JOURNAL_INTERVAL has passed.
+ */
+void editorJournalFlush(int force) {
+    if (journal.fd == -1 || journal.pending.len == 0)
+        return;
+    if (!force && editorNow() < journal.due)
+        return;
+
+    struct iovec iov = {journal.pending.b, journal.pending.len};
+    if (editorWriteIov(journal.fd, &iov, 1) == -1 ||
+        fdatasync(journal.fd) == -1) {
+        journal.failed = 1;
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+    }
+    journal.size += journal.pending.len;
+    abReset(&journal.pending);
+    journal.last = -1;
+    journal.due = 0;
+}
+
+/**
+ * Delete the journal, once there is nothing left in it worth keeping.
+ */
+void editorJournalRemove() {
+    if (journal.fd != -1) {
+        close(journal.fd);
+        unlink(journal.path);
+    }
+    free(journal.path);
+    journal.path = NULL;
+    journal.fd = -1;
+    journal.size = 0;
+    abReset(&journal.pending);
+    journal.last = -1;
+    journal.due = 0;
+}
+
+/**
+ * Mark the end of the journal, counting records not yet written. Later
+ * edits get records of their own rather than extending one before the
+ * mark.
+ *
+ * return: The position, or 0 if there is no journal.
+ */
+off_t editorJournalMark() {
+    if (journal.fd == -1)
+        return 0;
+    journal.last = -1;
+    return journal.size + journal.pending.len;
+}
+
+/**
+ * Bring the journal up to date after a save. The records up to the point
+ * where the save took its snapshot are in the file now. If there are
+ * none after it, the journal is deleted. Otherwise those records are kept
+ * under a header for the file as it is now.
+ *
+ * param pos: End of the journal when the save took its snapshot.
+ */
+void editorJournalSaved(off_t pos) {
+    if (journal.fd == -1)
+        return;
+    editorJournalFlush(1);
+    if (pos < journal.headerLen)
+        pos = journal.headerLen;
+    if (journal.size <= pos) {
+        editorJournalRemove();
+        return;
+    }
+
+    struct abuf ab = ABUF_INIT;
+    editorJournalHeader(&ab, E.filename);
+    int headerLen = ab.len;
+    int tailLen = journal.size - pos;
+    if (abReserve(&ab, tailLen) == -1)
+        die("editorJournalSaved: realloc");
+    char *tmp = malloc(strlen(journal.path) + 5);
+    if (tmp == NULL)
+        die("editorJournalSaved: malloc");
+    sprintf(tmp, "%s.new", journal.path);
+
+    int fd = -1;
+    if (pread(journal.fd, &ab.b[ab.len], tailLen, pos) == tailLen &&
+        (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600)) != -1) {
+        ab.len += tailLen;
+        struct iovec iov = {ab.b, ab.len};
+        if (editorWriteIov(fd, &iov, 1) == 0 && fdatasync(fd) == 0 &&
+            rename(tmp, journal.path) == 0) {
+            close(journal.fd);
+            journal.fd = fd;
+            journal.size = ab.len;
+            journal.headerLen = headerLen;
+            fd = -1;
+        } else {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    abFree(&ab);
+}
+
+/**
+ * Read a varint from a journal.
+ *
+ * param p: Where to read from, moved past the varint.
+ * param end: End of the journal.
+ * param n: Set to the number read.
+ * return: 0 on success, -1 if the journal ends first.
+ */
+int editorJournalVarint(const char **p, const char *end, int *n) {
+    unsigned long long v = 0;
+    int shift = 0;
+    while (*p < end && shift < 63) {
+        unsigned char c = *(*p)++;
+        v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            if (v > 0x7fffffff)
+                return -1;
+            *n = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+/**
+ * Apply the records in a journal to the text, stopping at the first one
+ * that is cut short or does not fit the text.
+ *
+ * param p: The first record.
+ * param end: End of the journal.
+ * return: End of the last record applied.
+ */
+const char *editorJournalReplay(const char *p, const char *end) {
+    journal.replaying = 1;
+    while (p < end) {
+        const char *rec = p;
+        int op = *p++;
+        int row, col, len;
+        if (editorJournalVarint(&p, end, &row) == -1 ||
+            editorJournalVarint(&p, end, &col) == -1 ||
+            editorJournalVarint(&p, end, &len) == -1 ||
+            row > E.numRows ||
+            col > (row < E.numRows ? tsRow(&E.text, row)->size : 0)) {
+            p = rec;
+            break;
+        }
+        if (op == 'i' && len <= end - p) {
+            E.cy = row;
+            E.cx = col;
+            editorInsertText(p, len);
+            p += len;
+        } else if (op == 'd' && row < E.numRows) {
+            editorDeleteRange(row, col, len);
+        } else {
+            p = rec;
+            break;
+        }
+    }
+    journal.replaying = 0;
+    /* Only the insertions were recorded for undo. */
+    editorUndoClear();
+    return p;
+}
+
+/**
+ * Offer to recover the edits in a journal left behind by a session that
+ * did not end cleanly, and carry on with that journal if they are. A
+ * journal written for another version of the file is ignored, and will
+ * be replaced by the next edit.
+ */
+void editorJournalRecover() {
+    if (E.filename == NULL)
+        return;
+    char *path = editorJournalPath(E.filename);
+    int fd = open(path, O_RDWR | O_APPEND);
+    if (fd == -1) {
+        free(path);
+        return;
+    }
+
+    struct abuf ab = ABUF_INIT;
+    struct abuf header = ABUF_INIT;
+    editorJournalHeader(&header, E.filename);
+    struct stat st;
+    int ok = (fstat(fd, &st) == 0 && st.st_size < 0x7fffffff &&
+              abReserve(&ab, st.st_size) == 0 &&
+              pread(fd, ab.b, st.st_size, 0) == st.st_size);
+    ab.len = ok ? st.st_size : 0;
+    if (!ok || ab.len < header.len ||
+        memcmp(ab.b, header.b, header.len) != 0) {
+        editorSetStatusMessage("Ignoring %.40s, which is for another "
+                               "version of the file", path);
+        close(fd);
+        free(path);
+        abFree(&ab);
+        abFree(&header);
+        return;
+    }
+
+    int c;
+    E.prompting = 1;
+    editorSetStatusMessage("Unsaved changes to %.20s were found. Recover "
+                           "them? (y/n)", E.filename);
+    do {
+        editorRefreshScreen();
+        c = editorReadKey();
+    } while (c != 'y' && c != 'Y' && c != 'n' && c != 'N' && c != '\x1b');
+    E.prompting = 0;
+
+    if (c == 'y' || c == 'Y') {
+        const char *end = editorJournalReplay(&ab.b[header.len],
+                                              &ab.b[ab.len]);
+        journal.fd = fd;
+        journal.path = path;
+        journal.size = end - ab.b;
+        journal.headerLen = header.len;
+        /* Anything after the last whole record was cut short by the
+         * crash. */
+        ftruncate(fd, journal.size);
+        editorSetStatusMessage("Recovered unsaved changes from %.40s", path);
+    } else {
+        close(fd);
+        unlink(path);
+        free(path);
+        editorSetStatusMessage("Discarded unsaved changes");
+    }
+    abFree(&ab);
+    abFree(&header);
+}
+
+/*** screen ***/
+
+/**
+ * Count how many bytes at the start of a buffer are equal to the first,
+ * comparing eight at a time.
+ *
+ * param s: The bytes to scan.
+ * param len: Number of bytes in the buffer, at least 1.
+ * return: Length of the run of equal bytes.
+ */
+int screenSpanLength(const unsigned char *s, int len) {
+    uint64_t pattern = 0x0101010101010101ULL * s[0];
+    int n = 0;
+    while (n + 8 <= len) {
+        uint64_t w;
+        memcpy(&w, &s[n], 8);
+        if (w != pattern)
+            break;
+        n += 8;
+    }
+    while (n < len && s[n] == s[0])
+        n++;
+    return n;
+}
+
+/**
+ * Find the next control character, skipping eight bytes at a time while
+ * none of them are below space or equal to DEL.
+ *
+ * param s: The characters to scan.
+ * param len: Number of characters.
+ * return: Index of the first control character, or len if there is none.
+ */
+int screenNextControl(const char *s, int len) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    int j = 0;
+    while (j + 8 <= len) {
+        uint64_t w;
+        memcpy(&w, &s[j], 8);
+        uint64_t del = w ^ (ones * 0x7f);
+        if (((w - ones * 0x20) & ~w & highs) ||
+            ((del - ones) & ~del & highs))
+            break;
+        j += 8;
+    }
+    for (; j < len; j++) {
+        unsigned char c = s[j];
+        if (c < 0x20 || c == 0x7f)
+            break;
+    }
+    return j;
+}
+
+/**
+ * Size the screen grid to match the editor window. Nothing is assumed
+ * about what the terminal shows until the next frame clears it.
+ */
+void screenResize() {
+    screen.rows = E.screenRows + 2;
+    screen.cols = E.screenCols;
+    int cells = screen.rows * screen.cols;
+    screen.chars = realloc(screen.chars, cells);
+    screen.attrs = realloc(screen.attrs, cells);
+    screen.nextChars = realloc(screen.nextChars, cells);
+    screen.nextAttrs = realloc(screen.nextAttrs, cells);
+    if (cells && (screen.chars == NULL || screen.attrs == NULL ||
+                  screen.nextChars == NULL || screen.nextAttrs == NULL))
+        die("screenResize");
+    screen.valid = 0;
+}
+
+/**
+ * Write characters into the frame being drawn.
+ *
+ * param y: Screen row.
+ * param x: Screen column to start at.
+ * param s: Characters to write.
+ * param len: Number of characters, cut short at the edge of the screen.
+ * param attr: Attribute to give every character.
+ */
+void screenPut(int y, int x, const char *s, int len, unsigned char attr) {
+    if (len > screen.cols - x)
+        len = screen.cols - x;
+    if (len <= 0)
+        return;
+    memcpy(&screen.nextChars[y * screen.cols + x], s, len);
+    memset(&screen.nextAttrs[y * screen.cols + x], attr, len);
+}
+
+/**
+ * Blank a row of the frame being drawn from a column to its end.
+ *
+ * param y: Screen row.
+ * param x: Screen column to start at.
+ */
+void screenClearLine(int y, int x) {
+    if (x >= screen.cols)
+        return;
+    memset(&screen.nextChars[y * screen.cols + x], ' ', screen.cols - x);
+    memset(&screen.nextAttrs[y * screen.cols + x], 0, screen.cols - x);
+}
+
+/**
+ * Move the terminal cursor, unless it is already there.
+ *
+ * param ab: A dynamic string to append escape sequences to.
+ * param y: Screen row.
+ * param x: Screen column.
+ */
+void screenMoveTo(struct abuf *ab, int y, int x) {
+    if (screen.cursorY == y && screen.cursorX == x)
+        return;
+    abAppendMoveTo(ab, y, x);
+    screen.cursorY = y;
+    screen.cursorX = x;
+}
+
+/**
+ * Switch the terminal from one cell attribute to another.
+ *
+ * param ab: A dynamic string to append escape sequences to.
+ * param from: The attribute in effect.
+ * param to: The attribute wanted.
+ */
+void screenSetAttr(struct abuf *ab, unsigned char from, unsigned char to) {
+    if (from == to)
+        return;
+    if ((from & ATTR_INVERSE) && !(to & ATTR_INVERSE)) {
+        abAppend(ab, "\x1b[m", 3);
+        from = 0;
+    }
+    if ((to & ATTR_INVERSE) && !(from & ATTR_INVERSE))
+        abAppend(ab, "\x1b[7m", 4);
+    int fg = to & ~ATTR_INVERSE;
+    if (fg != (from & ~ATTR_INVERSE))
+        abAppendSGR(ab, fg ? fg : 39);
+}
+
+/**
+ * Send a run of cells from the frame being drawn and note that the
+ * terminal now shows them. Cells are sent in spans of one attribute, each
+ * a single copy after its escape sequence.
+ *
+ * param ab: A dynamic string to append output to.
+ * param y: Screen row.
+ * param from: First column to send.
+ * param to: Column just past the last one to send.
+ * param attr: The attribute in effect, updated as the cells are sent.
+ */
+void screenEmit(struct abuf *ab, int y, int from, int to,
+                unsigned char *attr) {
+    int off = y * screen.cols;
+    int x = from;
+    screenMoveTo(ab, y, from);
+    while (x < to) {
+        int n = screenSpanLength(&screen.nextAttrs[off + x], to - x);
+        screenSetAttr(ab, *attr, screen.nextAttrs[off + x]);
+        *attr = screen.nextAttrs[off + x];
+        abAppend(ab, &screen.nextChars[off + x], n);
+        x += n;
+    }
+    memcpy(&screen.chars[off + from], &screen.nextChars[off + from],
+           to - from);
+    memcpy(&screen.attrs[off + from], &screen.nextAttrs[off + from],
+           to - from);
+    /* Writing the last column leaves the cursor waiting to wrap, and
+     * terminals disagree on where that is. */
+    screen.cursorX = to < screen.cols ? to : -1;
+}
+
+/**
+ * Check whether a row holds bytes outside ASCII. Those may take up fewer
+ * columns than bytes on the terminal, so cells on such a row cannot be
+ * updated in place.
+ *
+ * param s: The row's characters.
+ * param len: Length of the row.
+ * return: 1 if the row holds a non-ASCII byte, 0 if not.
+ */
+int screenRowIsWide(const char *s, int len) {
+    int j;
+    for (j = 0; j < len; j++)
+        if (s[j] & 0x80)
+            return 1;
+    return 0;
+}
+
+/**
+ * Scroll part of the screen with the terminal's own scrolling, so that
+ * rows already on screen do not have to be sent again. The grid is
+ * shifted to match and the rows that scroll into view are left blank.
+ *
+ * param ab: A dynamic string to append escape sequences to.
+ * param top: First screen row of the part to scroll.
+ * param bottom: Screen row just past the part to scroll.
+ * param n: Rows to scroll up by, or down by if negative. Must be less
+ *     than the height of the part.
+ */
+void screenScroll(struct abuf *ab, int top, int bottom, int n) {
+    abAppend(ab, "\x1b[", 2);
+    abAppendNum(ab, top + 1);
+    abAppendByte(ab, ';');
+    abAppendNum(ab, bottom);
+    abAppendByte(ab, 'r');
+    abAppend(ab, "\x1b[", 2);
+    abAppendNum(ab, n > 0 ? n : -n);
+    abAppendByte(ab, n > 0 ? 'S' : 'T');
+    abAppend(ab, "\x1b[r", 3);
+    /* Setting the scroll region homes the cursor. */
+    screen.cursorY = -1;
+
+    int keep = (bottom - top - (n > 0 ? n : -n)) * screen.cols;
+    int from = (n > 0 ? top + n : top) * screen.cols;
+    int to = (n > 0 ? top : top - n) * screen.cols;
+    int blank = (n > 0 ? bottom - n : top) * screen.cols;
+    int blankLen = (n > 0 ? n : -n) * screen.cols;
+    memmove(&screen.chars[to], &screen.chars[from], keep);
+    memmove(&screen.attrs[to], &screen.attrs[from], keep);
+    memset(&screen.chars[blank], ' ', blankLen);
+    memset(&screen.attrs[blank], 0, blankLen);
+}
+
+/**
+ * Work out the escape sequences that turn what the terminal shows into
+ * the frame that has been drawn, row by row. Runs of changed cells are
+ * sent with a cursor move in front of them, and a row that ends in blanks
+ * is cut short with an erase instead of sending the spaces.
+ *
+ * param ab: A dynamic string to append output to.
+ */
+void screenFlush(struct abuf *ab) {
+    if (!screen.valid) {
+        abAppend(ab, "\x1b[H\x1b[2J", 7);
+        memset(screen.chars, ' ', screen.rows * screen.cols);
+        memset(screen.attrs, 0, screen.rows * screen.cols);
+        screen.cursorY = 0;
+        screen.cursorX = 0;
+        screen.valid = 1;
+    }
+
+    unsigned char attr = 0;
+    int y;
+    for (y = 0; y < screen.rows; y++) {
+        int off = y * screen.cols;
+        char *next = &screen.nextChars[off];
+        unsigned char *nextAttrs = &screen.nextAttrs[off];
+        char *cur = &screen.chars[off];
+        unsigned char *curAttrs = &screen.attrs[off];
+        if (!memcmp(cur, next, screen.cols) &&
+            !memcmp(curAttrs, nextAttrs, screen.cols))
+            continue;
+
+        /* Columns from tail onwards are blank in the new frame. */
+        int tail = screen.cols;
+        while (tail > 0 && next[tail - 1] == ' ' && nextAttrs[tail - 1] == 0)
+            tail--;
+
+        if (screenRowIsWide(cur, screen.cols) ||
+            screenRowIsWide(next, screen.cols)) {
+            /* Resend the whole row and erase whatever follows it. A row
+             * that fills the width leaves the cursor on its last cell
+             * with a wrap pending, where erasing would wipe that cell. */
+            screenEmit(ab, y, 0, tail, &attr);
+            screenSetAttr(ab, attr, 0);
+            attr = 0;
+            if (tail < screen.cols) {
+                abAppend(ab, "\x1b[K", 3);
+                memset(&cur[tail], ' ', screen.cols - tail);
+                memset(&curAttrs[tail], 0, screen.cols - tail);
+            }
+            screen.cursorX = -1;
+            continue;
+        }
+
+        int x = 0;
+        while (x < tail) {
+            if (cur[x] == next[x] && curAttrs[x] == nextAttrs[x]) {
+                x++;
+                continue;
+            }
+            /* Keep sending through short stretches of unchanged cells,
+             * which is cheaper than moving the cursor over them. */
+            int end = x + 1;
+            int scan = end;
+            while (scan < tail && scan - end < KILO_DIFF_GAP) {
+                if (cur[scan] != next[scan] || curAttrs[scan] != nextAttrs[scan])
+                    end = scan + 1;
+                scan++;
+            }
+            screenEmit(ab, y, x, end, &attr);
+            x = end;
+        }
+
+        while (x < screen.cols && cur[x] == ' ' && curAttrs[x] == 0)
+            x++;
+        if (x < screen.cols) {
+            screenMoveTo(ab, y, x);
+            screenSetAttr(ab, attr, 0);
+            attr = 0;
+            abAppend(ab, "\x1b[K", 3);
+            memset(&cur[x], ' ', screen.cols - x);
+            memset(&curAttrs[x], 0, screen.cols - x);
+        }
+    }
+    screenSetAttr(ab, attr, 0);
+}
+
+/*** output ***/
+
+/**
+ * Check if the cursor has moved outside of the visible window. If so,
+ * adjust the cursor so that it is in the visible window.
+ */
+void editorScroll() {
+    E.rx = 0;
+    if (E.cy < E.numRows)
+        E.rx = editorRowCxToRx(tsRow(&E.text, E.cy), E.cx);
+
+    if (E.cy < E.rowOff)
+        E.rowOff = E.cy;
+    if (E.cy >= E.rowOff + E.screenRows)
+        E.rowOff = E.cy - E.screenRows + 1;
+    if (E.rx < E.colOff)
+        E.colOff = E.rx;
+    if (E.rx >= E.colOff + E.screenCols)
+        E.colOff = E.rx - E.screenCols + 1;
+}
+
+/**
+ * Draw the visible part of the file into the screen grid, with tildes at
+ * the start of any line that is not part of a file.
+ */
+void editorDrawRows() {
+    editorPrepareRows(E.rowOff - KILO_RENDER_LOOKAHEAD,
+                      E.rowOff + E.screenRows + KILO_RENDER_LOOKAHEAD);
+    editorSearchSpans(E.rowOff, E.rowOff + E.screenRows);
+
+    int span = 0;
+    int y;
+    for (y = 0; y < E.screenRows; y++) {
+        int fileRow = y + E.rowOff;
+        int x = 0;
+        if (fileRow >= E.numRows) {
+            if (E.numRows == 0 && y == E.screenRows/3) {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                    "Kilo editor -- version %s", KILO_VERSION);
+                if (welcomelen > E.screenCols)
+                    welcomelen = E.screenCols;
+                int padding = (E.screenCols - welcomelen) / 2;
+                if (padding) {
+                    screenPut(y, x++, "~", 1, 0);
+                    padding--;
+                }
+                screenClearLine(y, x);
+                x += padding;
+                screenPut(y, x, welcome, welcomelen, 0);
+                x += welcomelen;
+            } else {
+                screenPut(y, x++, "~", 1, 0);
+            }
+        } else {
+            erow *row = tsRow(&E.text, fileRow);
+            int len = row->rsize - E.colOff;
+            if (len < 0)
+                len = 0;
+            if (len > E.screenCols)
+                len = E.screenCols;
+            char *c = &row->render[E.colOff];
+            unsigned char *hl = &row->hl[E.colOff];
+            char *cells = &screen.nextChars[y * screen.cols];
+            unsigned char *attrs = &screen.nextAttrs[y * screen.cols];
+            while (x < len) {
+                int n = screenSpanLength(&hl[x], len - x);
+                memcpy(&cells[x], &c[x], n);
+                memset(&attrs[x], hl[x] == HL_NORMAL ? 0 :
+                       editorSyntaxToColor(hl[x]), n);
+                x += n;
+            }
+
+            /* Matches for the search are drawn over the syntax colours,
+             * with the one the cursor is on inverted. */
+            while (span < search.numSpans &&
+                   search.spans[span].row == fileRow) {
+                struct searchSpan *sp = &search.spans[span++];
+                int from = sp->rx - E.colOff;
+                int to = sp->rxEnd - E.colOff;
+                if (from < 0)
+                    from = 0;
+                if (to > len)
+                    to = len;
+                if (from < to)
+                    memset(&attrs[from], editorSyntaxToColor(HL_MATCH) |
+                           (sp->match == search.current ? ATTR_INVERSE : 0),
+                           to - from);
+            }
+
+            /* Control characters are shown inverted, in the colour of the
+             * text before them. */
+            int j = 0;
+            while ((j += screenNextControl(&c[j], len - j)) < len) {
+                cells[j] = (c[j] <= 26 ? '@' + c[j] : '?');
+                attrs[j] = ATTR_INVERSE | (j ? attrs[j - 1] & ~ATTR_INVERSE : 0);
+                j++;
+            }
+        }
+        screenClearLine(y, x);
+    }
+}
+
+/**
+ * Draw a status bar into the screen grid.
+ */
+void editorDrawStatusBar() {
+    int y = E.screenRows;
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                       E.filename ? E.filename : "[No Name]", E.numRows,
+                       E.dirty ? "(modified)" : "");
+    char found[48] = "";
+    if (search.active && search.error) {
+        snprintf(found, sizeof(found), "bad pattern: %s | ", search.error);
+    } else if (search.active && search.queryLen > 0) {
+        if (search.current == -1)
+            snprintf(found, sizeof(found), "no matches | ");
+        else
+            snprintf(found, sizeof(found), "match %lld of %lld | ",
+                     search.current + 1, search.numMatches);
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s%s%s | %d/%d", found,
+                        (search.active && (search.flags & SEARCH_IGNORE_CASE)) ?
+                            "nocase " : "",
+                        (search.active && (search.flags & SEARCH_WHOLE_WORD)) ?
+                            "word " : "",
+                        (search.active && (search.flags & SEARCH_REGEX)) ?
+                            "regex " : "",
+                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                        E.numRows);
+    if (len > E.screenCols)
+        len = E.screenCols;
+    screenPut(y, 0, status, len, ATTR_INVERSE);
+    while (len < E.screenCols) {
+        if (E.screenCols - len == rlen) {
+            screenPut(y, len, rstatus, rlen, ATTR_INVERSE);
+            break;
+        } else {
+            screenPut(y, len, " ", 1, ATTR_INVERSE);
+            len++;
+        }
+    }
+}
+
+/**
+ * Draw a Message bar into the screen grid.
+ */
+void editorDrawMessageBar() {
+    int y = E.screenRows + 1;
+    int msgLen = strlen(E.statusMsg);
+    if (msgLen > E.screenCols)
+        msgLen = E.screenCols;
+    if (!msgLen || (!E.prompting &&
+                    time(NULL) - E.statusMsg_time >= KILO_MSG_TIMEOUT))
+        msgLen = 0;
+    screenPut(y, 0, E.statusMsg, msgLen, 0);
+    screenClearLine(y, msgLen);
+}
+
+/**
+ * Refresh the terminal screen. The frame is drawn into the screen grid
+ * and only what differs from the last frame is written out.
+ */
+void editorRefreshScreen() {
+    editorScroll();
+
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    abReset(&frame);
+    abAppend(&frame, "\x1b[?25l", 6); // hide the cursor
+    int hidden = frame.len;
+
+    /* When the view has moved up or down by less than a screen, let the
+     * terminal move the rows that are still visible. */
+    int shift = E.rowOff - screen.rowOff;
+    if (screen.valid && shift != 0 && shift > -E.screenRows &&
+        shift < E.screenRows)
+        screenScroll(&frame, 0, E.screenRows, shift);
+    screen.rowOff = E.rowOff;
+
+    screenFlush(&frame);
+
+    int cy = E.cy - E.rowOff;
+    int cx = E.rx - E.colOff;
+    if (frame.len == hidden) {
+        /* Nothing changed, so there is no need to hide the cursor. */
+        abReset(&frame);
+        screenMoveTo(&frame, cy, cx);
+    } else {
+        screenMoveTo(&frame, cy, cx);
+        abAppend(&frame, "\x1b[?25h", 6); // show the cursor again
+    }
+
+    screen.written += frame.len;
+    if (frame.len && !E.headless)
+        write(STDOUT_FILENO, frame.b, frame.len);
+    screen.lastFrame = editorNow();
+}
+
+/**
+ * Set the status message for the kilo editor and note the time it
+ * was set.
+ *
+ * param fmt: A format string.
+ */
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
+    va_end(ap);
+    E.statusMsg_time = time(NULL);
+}
+
+/*** events ***/
+
+/**
+ * Note that the terminal has changed size and wake the main loop.
+ *
+ * param sig: Unused.
+ */
+void handleSigWinch(int sig) {
+    (void)sig;
+    int savedErrno = errno;
+    resized = 1;
+    write(wakePipe[1], "w", 1);
+    errno = savedErrno;
+}
+
+/**
+ * Set up the pipe that wakes the main loop and catch window size
+ * changes.
+ */
+void editorInitEvents() {
+    if (pipe(wakePipe) == -1)
+        die("editorInitEvents: pipe");
+    int j;
+    for (j = 0; j < 2; j++) {
+        int flags = fcntl(wakePipe[j], F_GETFL);
+        if (flags == -1 || fcntl(wakePipe[j], F_SETFL, flags | O_NONBLOCK) == -1)
+            die("editorInitEvents: fcntl");
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        die("editorInitEvents: sigaction");
+}
+
+/**
+ * Pick up the new size of the terminal window.
+ */
+void editorHandleResize() {
+    resized = 0;
+    if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
+        die("editorHandleResize: getWindowSize");
+    E.screenRows -= 2;
+    if (E.screenRows < 1)
+        E.screenRows = 1;
+    if (E.screenCols < 1)
+        E.screenCols = 1;
+    screenResize();
+}
+
+/**
+ * Work out how long the main loop can sleep before something on screen
+ * has to change by itself, which is only ever the message bar clearing.
+ *
+ * return: Milliseconds to wait, or -1 to wait for input.
+ */
+int editorNextTimeout() {
+    int wait = -1;
+    if (E.statusMsg[0] != '\0' && !E.prompting) {
+        time_t left = E.statusMsg_time + KILO_MSG_TIMEOUT - time(NULL);
+        if (left > 0)
+            wait = left * 1000;
+    }
+    if (journal.due) {
+        long long left = journal.due - editorNow();
+        if (left < 0)
+            left = 0;
+        if (wait == -1 || left < wait)
+            wait = left;
+    }
+    return wait;
+}
+
+/**
+ * Sleep until there is input to decode. Window size changes, finished
+ * background work and timers that arrive in the meantime are dealt
+ * with as they come, and the screen is redrawn at most once per wakeup
+ * when one of them needs it.
+ */
+void editorWaitForInput() {
+    while (!inputPending()) {
+        if (save.deferred && editorCollectSave(0)) {
+            editorRefreshScreen();
+            continue;
+        }
+        if (E.headless) {
+            if (inputFill(0) == 0) {
+                errno = ENODATA;
+                die("editorWaitForInput: script ended");
+            }
+            continue;
+        }
+        editorJournalFlush(0);
+        struct pollfd fds[2] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {wakePipe[0], POLLIN, 0}
+        };
+        int n = poll(fds, 2, editorNextTimeout());
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("editorWaitForInput: poll");
+        }
+
+        int redraw = (n == 0);
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+                ;
+            editorCollectHighlights();
+            if (editorCollectSave(0))
+                redraw = 1;
+            if (resized) {
+                editorHandleResize();
+                redraw = 1;
+            }
+        }
+        if (fds[0].revents)
+            inputFill(0);
+
+        if (redraw && !inputPending())
+            editorRefreshScreen();
+    }
+}
+
+/**
+ * Hold back the next frame until KILO_FRAME_RATE allows it, taking in
+ * any keys that arrive in the meantime. When keys come faster than the
+ * frame rate, as they do with auto-repeat, they are all handled before
+ * the screen is drawn once. The frame after a burst of keys is drawn as
+ * soon as the frame rate allows.
+ *
+ * return: 1 if more keys arrived, 0 if it is time to draw.
+ */
+int editorWaitForFrame() {
+    long long wait = screen.lastFrame + 1000 / KILO_FRAME_RATE - editorNow();
+    if (wait <= 0)
+        return 0;
+    inputFill(wait);
+    return inputPending();
+}
+
+/*** input ***/
+
+/* Text waiting to be inserted in one go, from a paste or a burst of
+ * typing. Kept between keys so that it is only allocated once. */
+struct abuf pending = ABUF_INIT;
+
+/**
+ * Collect the text of a bracketed paste, up to the sequence that ends it.
+ * The paste is also taken to have ended if input stops arriving for a
+ * while.
+ *
+ * param ab: A dynamic string to append the pasted text to.
+ */
+void editorReadPaste(struct abuf *ab) {
+    int idle = 0;
+    while (idle < KILO_PASTE_WAIT) {
+        if (!inputPending() && inputFill(KILO_KEY_TIMEOUT) == 0) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        char *p = &input.buf[input.start];
+        int len = input.end - input.start;
+        char *esc = memchr(p, '\x1b', len);
+        int run = esc ? esc - p : len;
+        abAppend(ab, p, run);
+        input.start += run;
+        if (esc == NULL)
+            continue;
+
+        if (inputPeek(1) == '[' && inputPeek(2) == '2' &&
+            inputPeek(3) == '0' && inputPeek(4) == '1' &&
+            inputPeek(5) == '~') {
+            input.start += 6;
+            return;
+        }
+        abAppendByte(ab, '\x1b');
+        input.start++;
+    }
+}
+
+/**
+ * Insert the key just read, together with any printable characters that
+ * were typed straight after it and are already buffered.
+ *
+ * param c: The key just read.
+ */
+void editorInsertTyped(int c) {
+    if (c < ' ' || c == BACKSPACE) {
+        editorInsertChar(c);
+        return;
+    }
+
+    abReset(&pending);
+    abAppendByte(&pending, c);
+    while (inputPending()) {
+        unsigned char next = input.buf[input.start];
+        if ((next < ' ' && next != '\t') || next == BACKSPACE)
+            break;
+        abAppendByte(&pending, next);
+        input.start++;
+    }
+    editorInsertText(pending.b, pending.len);
+}
+
+/**
+ * Display a prompt to the user.
+ *
+ * param prompt: Text to display to the user.
+ * param callback: A callback function for incremental searching.
+ * return: User input.
+ */
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while(1) {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+        
+        E.prompting = 1;
+        int c = editorReadKey();
+        E.prompting = 0;
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            if (buflen != 0)
+                buf[--buflen] = '\0';
+        } else if (c == '\x1b'){
+            editorSetStatusMessage("");
+            if (callback)
+                callback(buf, c);
+            free(buf);
+            return NULL;
+         } else if (c == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMessage("");
+                if (callback)
+                    callback(buf, c);
+                return buf;
+            }
+        } else if (!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+
+        if (callback)
+            callback(buf, c);
+    }
+}
+
+/**
+ * Move the cursor given a specific keypress. 
+ *
+ * param key: A key that has been pressed, encoded as an int.
+ */
+void editorMoveCursor(int key) {
+    erow *row = (E.cy >= E.numRows) ? NULL : tsRow(&E.text, E.cy);
+
+    switch (key) {
+        case ARROW_LEFT:
+            if (E.cx != 0) {
+                E.cx--;
+            } else if (E.cy > 0) {
+                E.cy--;
+                E.cx = tsRow(&E.text, E.cy)->size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (row && E.cx < row->size) {
+                E.cx++;
+            } else if (row && E.cx == row->size) {
+                E.cy++;
+                E.cx = 0;
+            }
+            break;
+        case ARROW_UP:
+            if (E.cy != 0)
+                E.cy--;
+            break;
+        case ARROW_DOWN:
+            if (E.cy < E.numRows)
+                E.cy++;
+            break;
+    }
+
+    row = (E.cy >= E.numRows) ? NULL : tsRow(&E.text, E.cy);
+    int rowLen = row ? row->size : 0;
+    if (E.cx > rowLen)
+        E.cx = rowLen;
+}
+
+/**
+ * Wait for a keypress then handle it.
+ */
+void editorProcessKeypress() {
+    static int quit_times = KILO_QUIT_TIMES;
+
+    int c = editorReadKey();
+
+    switch (c) {
+        case '\r':
+            editorInsertNewLine();
+            break;
+
+        case CTRL_KEY('q'):
+            editorCollectSave(1);
+            if (E.dirty && quit_times > 0) {
+                editorSetStatusMessage("Warning!!! File has unsaved "
+                                       "changes. Press CTRL-Q %d more "
+                                       "times to quit.", quit_times);
+                quit_times--;
+                return;
+            }
+            editorJournalRemove();
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+            break;
+
+        case CTRL_KEY('s'):
+         editorSave();
+         break;
+
+        case HOME_KEY:
+            E.cx = 0;
+            break;
+
+        case END_KEY:
+            if (E.cy < E.numRows)
+                E.cx = tsRow(&E.text, E.cy)->size;
+            break;
+
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+    
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (c == DEL_KEY)
+                editorMoveCursor(ARROW_RIGHT);
+            editorDelChar();
+            break;
+    
+        case PAGE_UP:
+        case PAGE_DOWN:
+            {
+                if (c == PAGE_UP) {
+                    E.cy = E.rowOff;
+                } else if (c == PAGE_DOWN){
+                    E.cy = E.rowOff + E.screenRows - 1;
+                    if (E.cy > E.numRows)
+                        E.cy = E.numRows;
+                }
+
+                int times = E.screenRows;
+                while (times--)
+                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            }
+            break;
+
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            editorMoveCursor(c);
+            break;
+
+        case PASTE_START:
+            /* A paste is undone on its own, apart from any typing around
+             * it. */
+            abReset(&pending);
+            editorReadPaste(&pending);
+            editorUndoBreak();
+            editorInsertText(pending.b, pending.len);
+            editorUndoBreak();
+            break;
+
+        case CTRL_KEY('l'):
+        case '\x1b':
+        case PASTE_END:
+            break;
+
+        default:
+            editorInsertTyped(c);
+            break;
+    }
+
+    quit_times = KILO_QUIT_TIMES;
+}
+
+/*** bench ***/
+
+#ifdef KILO_BENCH
+
+/* Allocations made by the editor since the benchmark started. Background
+ * threads allocate too, so the count is updated atomically. */
+unsigned long benchAllocs = 0;
+
+/**
+ * Count an allocation and make it.
+ *
+ * param size: Number of bytes.
+ * return: The memory, or NULL.
+ */
+void *benchMalloc(size_t size) {
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return (malloc)(size);
+}
+
+/**
+ * Count an allocation and make it, zeroed.
+ *
+ * param n: Number of elements.
+ * param size: Size of an element.
+ * return: The memory, or NULL.
+ */
+void *benchCalloc(size_t n, size_t size) {
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return (calloc)(n, size);
+}
+
+/**
+ * Count a reallocation and make it.
+ *
+ * param p: The memory to resize, or NULL.
+ * param size: New number of bytes.
+ * return: The memory, or NULL.
+ */
+void *benchRealloc(void *p, size_t size) {
+    __atomic_add_fetch(&benchAllocs, 1, __ATOMIC_RELAXED);
+    return (realloc)(p, size);
+}
+
+/* A file to run the benchmark on, with what to search it for. */
+struct benchCorpus {
+    const char *name;
+    char *path;
+    const char *query;
+    const char *pattern;
+};
+
+/* A sequence of operations. key appends the keys for operation i to ab. */
+struct benchScenario {
+    const char *name;
+    int ops;
+    void (*key)(struct abuf *ab, struct benchCorpus *c, int i);
+};
+
+/**
+ * Read a clock that only ever moves forwards.
+ *
+ * return: Time in microseconds.
+ */
+long long benchMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Compare two latencies, for qsort.
+ */
+int benchCompare(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Step a pseudo-random number generator, so that the corpus is the same
+ * on every run.
+ *
+ * param state: The generator's state.
+ * return: The next number.
+ */
+unsigned int benchRandom(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 16;
+}
+
+/**
+ * Write a large server log.
+ *
+ * param fp: The file to write.
+ */
+void benchWriteLog(FILE *fp) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                   "ERROR"};
+    unsigned int r = 1;
+    int j;
+    for (j = 0; j < KILO_BENCH_LOG_ROWS; j++) {
+        fprintf(fp, "2026-10-16 %02d:%02d:%02d.%03d %-5s [worker-%02u] "
+                "request id=%08x path=/api/v1/items/%u status=%u "
+                "bytes=%u\n", j / 3600000 % 24, j / 60000 % 60,
+                j / 1000 % 60, j % 1000, levels[benchRandom(&r) % 6],
+                benchRandom(&r) % 32, benchRandom(&r) * 65599u,
+                benchRandom(&r) % 100000, 200 + benchRandom(&r) % 4 * 100,
+                benchRandom(&r) % 65536);
+    }
+}
+
+/**
+ * Write JSON with very long lines, as minified JSON has.
+ *
+ * param fp: The file to write.
+ */
+void benchWriteJson(FILE *fp) {
+    unsigned int r = 2;
+    int j, k;
+    for (j = 0; j < KILO_BENCH_JSON_ROWS; j++) {
+        fputc('[', fp);
+        for (k = 0; k < 1000; k++)
+            fprintf(fp, "%s{\"id\":%d,\"name\":\"item-%u\",\"tags\":"
+                    "[\"red\",\"large\"],\"price\":%u.%02u,\"active\":%s}",
+                    k ? "," : "", j * 1000 + k, benchRandom(&r),
+                    benchRandom(&r) % 1000, benchRandom(&r) % 100,
+                    benchRandom(&r) % 2 ? "true" : "false");
+        fputs("]\n", fp);
+    }
+}
+
+/**
+ * Write C with deeply nested blocks and many multi-line comments.
+ *
+ * param fp: The file to write.
+ */
+void benchWriteC(FILE *fp) {
+    int rows = 0;
+    int fn = 0;
+    while (rows < KILO_BENCH_C_ROWS) {
+        fprintf(fp, "/*\n * Function %d.\n *\n * Walks the nested levels "
+                "below. /* is not special\n * inside a comment.\n */\n"
+                "int func%d(int x, char *s) {\n", fn, fn);
+        rows += 7;
+        int depth;
+        for (depth = 1; depth <= 8; depth++) {
+            fprintf(fp, "%*s/* level %d: \"quoted\" 'c' 123 */\n"
+                    "%*sif (x > %d) { // check %d\n",
+                    depth * 4, "", depth, depth * 4, "", depth, depth);
+            rows += 2;
+        }
+        for (depth = 8; depth >= 1; depth--) {
+            fprintf(fp, "%*sx += strlen(\"level %d\\n\") * 0x%x;\n"
+                    "%*s}\n", depth * 4 + 4, "", depth, depth,
+                    depth * 4, "");
+            rows += 2;
+        }
+        fprintf(fp, "    return x;\n}\n\n");
+        rows += 3;
+        fn++;
+    }
+}
+
+/**
+ * Write a generated corpus file.
+ *
+ * param c: The corpus file, whose path is filled in.
+ * param dir: Directory to write it in.
+ * param ext: File name extension, which picks the syntax.
+ * param fill: Writes the contents.
+ */
+void benchGenerate(struct benchCorpus *c, const char *dir, const char *ext,
+                   void (*fill)(FILE *)) {
+    c->path = malloc(strlen(dir) + strlen(c->name) + strlen(ext) + 2);
+    if (c->path == NULL)
+        die("benchGenerate: malloc");
+    sprintf(c->path, "%s/%s%s", dir, c->name, ext);
+    FILE *fp = fopen(c->path, "w");
+    if (fp == NULL)
+        die("benchGenerate: fopen");
+    fill(fp);
+    if (fclose(fp) == EOF)
+        die("benchGenerate: fclose");
+}
+
+/**
+ * Press Page Down.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchPageDown(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    (void)i;
+    abAppend(ab, "\x1b[6~", 4);
+}
+
+/**
+ * Press the down arrow.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchArrowDown(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    (void)i;
+    abAppend(ab, "\x1b[B", 3);
+}
+
+/**
+ * Press the right arrow, which runs on to the next row at the end of one.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchArrowRight(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    (void)i;
+    abAppend(ab, "\x1b[C", 3);
+}
+
+/**
+ * Press End, then Home and the down arrow, in turn.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchEndHome(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    abAppend(ab, i % 2 ? "\x1b[H\x1b[B" : "\x1b[F", i % 2 ? 6 : 3);
+}
+
+/**
+ * Type a character of some text.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchType(struct abuf *ab, struct benchCorpus *c, int i) {
+    static const char text[] = "the quick brown fox jumps over the lazy dog ";
+    (void)c;
+    abAppendByte(ab, text[i % (sizeof(text) - 1)]);
+}
+
+/**
+ * Press Backspace.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchBackspace(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    (void)i;
+    abAppendByte(ab, BACKSPACE);
+}
+
+/**
+ * Paste a thousand lines.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchPaste(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    abAppend(ab, "\x1b[200~", 6);
+    int j;
+    for (j = 0; j < 1000; j++) {
+        char line[80];
+        int len = snprintf(line, sizeof(line), "pasted line %d of block %d "
+                           "with some more text after it\n", j, i);
+        abAppend(ab, line, len);
+    }
+    abAppend(ab, "\x1b[201~", 6);
+}
+
+/**
+ * Undo the last edit.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchUndo(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)c;
+    (void)i;
+    abAppendByte(ab, CTRL_KEY('z'));
+}
+
+/**
+ * Search for the corpus's query and stop at the first match.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchFind(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)i;
+    abAppendByte(ab, CTRL_KEY('f'));
+    abAppend(ab, c->query, strlen(c->query));
+    abAppendByte(ab, '\r');
+}
+
+/**
+ * Search for the corpus's pattern in regex mode and stop at the first
+ * match.
+ *
+ * param ab: Where to append the keys.
+ * param c: The file being edited.
+ * param i: Index of the operation.
+ */
+void benchFindRegex(struct abuf *ab, struct benchCorpus *c, int i) {
+    (void)i;
+    abAppendByte(ab, CTRL_KEY('f'));
+    if (!(search.flags & SEARCH_REGEX))
+        abAppendByte(ab, CTRL_KEY('r'));
+    abAppend(ab, c->pattern, strlen(c->pattern));
+    abAppendByte(ab, '\r');
+}
+
+struct benchScenario benchScenarios[] = {
+    {"page down", 200, benchPageDown},
+    {"arrow down", 500, benchArrowDown},
+    {"arrow right", 500, benchArrowRight},
+    {"end/home", 200, benchEndHome},
+    {"type", 1000, benchType},
+    {"backspace", 1000, benchBackspace},
+    {"paste 1k lines", 20, benchPaste},
+    {"undo paste", 20, benchUndo},
+    {"find literal", 5, benchFind},
+    {"find regex", 5, benchFindRegex},
+};
+
+#define BENCH_SCENARIOS (sizeof(benchScenarios) / sizeof(benchScenarios[0]))
+
+/**
+ * Run the keys for one operation the way the main loop would: handle
+ * every key, then draw a frame.
+ *
+ * param keys: The keys.
+ */
+void benchRunKeys(struct abuf *keys) {
+    input.script = keys->b;
+    input.scriptLen = keys->len;
+    while (inputPending() || inputFill(0)) {
+        editorProcessKeypress();
+        editorScroll();
+    }
+    editorRefreshScreen();
+}
+
+/**
+ * Run every scenario on one file and print a line for each. The cursor
+ * starts at the top of the file, and typing starts half way down.
+ *
+ * param c: The file.
+ */
+void benchRunCorpus(struct benchCorpus *c) {
+    unsigned long allocs = benchAllocs;
+    long long start = benchMicros();
+    editorOpen(c->path);
+    editorRefreshScreen();
+    printf("%-6s %-15s %6d %9.1f ms %22s %10s %9lu\n", c->name, "open", 1,
+           (benchMicros() - start) / 1000.0, "", "",
+           benchAllocs - allocs);
+
+    struct abuf keys = ABUF_INIT;
+    unsigned int s;
+    for (s = 0; s < BENCH_SCENARIOS; s++) {
+        struct benchScenario *sc = &benchScenarios[s];
+        if (strcmp(sc->name, "type") == 0) {
+            E.cy = E.numRows / 2;
+            E.cx = 0;
+        }
+
+        long long *lat = malloc(sizeof(long long) * sc->ops);
+        if (lat == NULL)
+            die("benchRunCorpus: malloc");
+        long long bytes = screen.written;
+        allocs = benchAllocs;
+        int j;
+        for (j = 0; j < sc->ops; j++) {
+            abReset(&keys);
+            sc->key(&keys, c, j);
+            start = benchMicros();
+            benchRunKeys(&keys);
+            lat[j] = benchMicros() - start;
+        }
+        bytes = screen.written - bytes;
+        allocs = benchAllocs - allocs;
+
+        qsort(lat, sc->ops, sizeof(long long), benchCompare);
+        printf("%-6s %-15s %6d %9lld us %9lld %9lld %9lld %10lld %9.1f\n",
+               c->name, sc->name, sc->ops, lat[(sc->ops - 1) * 50 / 100],
+               lat[(sc->ops - 1) * 90 / 100], lat[(sc->ops - 1) * 99 / 100],
+               lat[sc->ops - 1], bytes / sc->ops,
+               (double)allocs / sc->ops);
+        fflush(stdout);
+        free(lat);
+    }
+    abFree(&keys);
+}
+
+/**
+ * Run the benchmark. Each file is edited by a headless editor in a
+ * process of its own, so that every file starts from a fresh editor.
+ * Without files, a generated corpus is used: a large log, JSON with very
+ * long lines and deeply commented C.
+ *
+ * Usage: kilo-bench [-s ROWSxCOLS] [FILE...]
+ *
+ * return: The exit status.
+ */
+int benchMain(int argc, char **argv) {
+    int rows = 24, cols = 80;
+    int first = 1;
+    if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+        if (sscanf(argv[2], "%dx%d", &rows, &cols) != 2 || rows < 3 ||
+            cols < 1) {
+            fprintf(stderr, "Usage: %s [-s ROWSxCOLS] [FILE...]\n", argv[0]);
+            return 1;
+        }
+        first = 3;
+    }
+
+    struct benchCorpus *corpus;
+    int numCorpus;
+    char dir[] = "/tmp/kilo-bench.XXXXXX";
+    int generated = (first == argc);
+    if (generated) {
+        if (mkdtemp(dir) == NULL)
+            die("benchMain: mkdtemp");
+        static struct benchCorpus gen[] = {
+            {"log", NULL, "ERROR", "status=5[0-9]+"},
+            {"json", NULL, "large", "\"id\":[0-9]+7,"},
+            {"c", NULL, "strlen", "level [0-9]: \"[a-z]+\""},
+        };
+        benchGenerate(&gen[0], dir, ".log", benchWriteLog);
+        benchGenerate(&gen[1], dir, ".json", benchWriteJson);
+        benchGenerate(&gen[2], dir, ".c", benchWriteC);
+        corpus = gen;
+        numCorpus = 3;
+    } else {
+        numCorpus = argc - first;
+        corpus = malloc(sizeof(*corpus) * numCorpus);
+        if (corpus == NULL)
+            die("benchMain: malloc");
+        int j;
+        for (j = 0; j < numCorpus; j++) {
+            char *slash = strrchr(argv[first + j], '/');
+            corpus[j].name = slash ? slash + 1 : argv[first + j];
+            corpus[j].path = argv[first + j];
+            corpus[j].query = "the";
+            corpus[j].pattern = "t[a-z]+e";
+        }
+    }
+
+    printf("screen %dx%d\n", rows, cols);
+    printf("%-6s %-15s %6s %12s %9s %9s %9s %10s %9s\n", "file",
+           "operation", "ops", "p50", "p90", "p99", "max", "bytes/op",
+           "allocs/op");
+    fflush(stdout);
+
+    int status = 0;
+    int j;
+    for (j = 0; j < numCorpus; j++) {
+        pid_t pid = fork();
+        if (pid == -1)
+            die("benchMain: fork");
+        if (pid == 0) {
+            E.headless = 1;
+            E.screenRows = rows;
+            E.screenCols = cols;
+            initEditor();
+            benchRunCorpus(&corpus[j]);
+            exit(0);
+        }
+        int st;
+        if (waitpid(pid, &st, 0) == -1 || !WIFEXITED(st) ||
+            WEXITSTATUS(st) != 0)
+            status = 1;
+    }
+
+    if (generated) {
+        for (j = 0; j < numCorpus; j++)
+            unlink(corpus[j].path);
+        rmdir(dir);
+    }
+    return status;
+}
+
+#endif
+
+#ifdef KILO_CHECK
+
+/* Sizes of the randomized checks. */
+#define CHECK_PATTERNS 3000
+#define CHECK_EDIT_RUNS 300
+#define CHECK_EDITS 200
+
 /**
- * Draw tildes at the start of any line that is not part of a file.
+ * Make a random pattern that POSIX extended patterns and reCompile()
+ * agree on the meaning of. Anchors are never repeated, neither on their
+ * own, which POSIX leaves undefined, nor inside a repeated group, which
+ * glibc gets wrong.
  *
- * param ab: A dynamic string to append characters to.
+ * param ab: The dynamic string to append the pattern to.
+ * param depth: How many more groups may be nested.
+ * param anchors: Whether the pattern may have anchors.
  */
-void editorDrawRows(struct abuf *ab) {
-    int y;
-    for (y = 0; y < E.screenRows; y++) {
-        int fileRow = y + E.rowOff;
-        if (fileRow >= E.numRows) {
-            if (E.numRows == 0 && y == E.screenRows/3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                    "Kilo editor -- version %s", KILO_VERSION);
-                if (welcomelen > E.screenCols)
-                    welcomelen = E.screenCols;
-                int padding = (E.screenCols - welcomelen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-            } else {
-                abAppend(ab, "~", 1);
-            }
+void checkPattern(struct abuf *ab, int depth, int anchors) {
+    static const char *atoms[] = {"a", "b", "c", ".", "[ab]", "[^a]", "B",
+                                  "^", "$"};
+    int numAtoms = sizeof(atoms) / sizeof(atoms[0]) - (anchors ? 0 : 2);
+    int pieces = 1 + rand() % 3;
+    while (pieces--) {
+        char repeat = rand() % 3 == 0 ? "*+?"[rand() % 3] : '\0';
+        if (depth > 0 && rand() % 5 == 0) {
+            abAppendByte(ab, '(');
+            checkPattern(ab, depth - 1, anchors && !repeat);
+            abAppendByte(ab, ')');
         } else {
-            int len = E.row[fileRow].rsize - E.colOff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screenCols)
-                len = E.screenCols;
-            char *c = &E.row[fileRow].render[E.colOff];
-            unsigned char *hl = &E.row[fileRow].hl[E.colOff];
-            int currentColor = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26 ? '@' + c[j] : '?');
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (currentColor != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (currentColor != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        currentColor = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != currentColor) {
-                        currentColor = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            int j = rand() % numAtoms;
+            abAppend(ab, atoms[j], strlen(atoms[j]));
+            if (atoms[j][0] == '^' || atoms[j][0] == '$')
+                repeat = '\0';
         }
-        
-        abAppend(ab, "\x1b[K", 3); // clear the rest this line
-        abAppend(ab, "\r\n", 2);
+        if (repeat)
+            abAppendByte(ab, repeat);
+    }
+    if (rand() % 4 == 0) {
+        abAppendByte(ab, '|');
+        checkPattern(ab, depth, anchors);
     }
 }
 
 /**
- * Draw a status bar.
+ * Append a random line to a dynamic string. Some lines are long runs of
+ * one letter, which make the search fall back to its backwards pass.
  *
- * param ab: A dynamic string to append characters to.
+ * param ab: The dynamic string.
  */
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No Name]", E.numRows,
-                       E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
-                        E.numRows);
-    if (len > E.screenCols)
-        len = E.screenCols;
-    abAppend(ab, status, len);
-    while (len < E.screenCols) {
-        if (E.screenCols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+void checkLine(struct abuf *ab) {
+    int len = rand() % 12;
+    int run = (rand() % 4 == 0) ? 40 + rand() % 60 : 0;
+    while (run--)
+        abAppendByte(ab, 'a');
+    while (len--)
+        abAppendByte(ab, "abcAB "[rand() % 6]);
+}
+
+/**
+ * Find the matches for a pattern in a line the way the search does, but
+ * with regcomp() and regexec(): leftmost-longest, not overlapping, and
+ * skipping empty matches.
+ *
+ * param re: The pattern, compiled by regcomp().
+ * param s: The line, NUL terminated.
+ * param out: Set to the start and end of each match in turn.
+ * return: Number of matches.
+ */
+int checkPosixMatches(regex_t *re, const char *s, int *out) {
+    int len = strlen(s);
+    int at = 0;
+    int n = 0;
+    while (at <= len) {
+        regmatch_t m;
+        if (regexec(re, &s[at], 1, &m, at ? REG_NOTBOL : 0) != 0)
             break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
+        int start = at + m.rm_so;
+        int end = at + m.rm_eo;
+        if (end == start) {
+            at = start + 1;
+            continue;
         }
+        out[n * 2] = start;
+        out[n * 2 + 1] = end;
+        n++;
+        at = end;
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    return n;
 }
 
 /**
- * Draw a Message bar.
- *
- * param ab: A dynamic string to append characters to.
+ * Get rid of every row, and the file they were read from.
  */
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
-    int msgLen = strlen(E.statusMsg);
-    if (msgLen > E.screenCols)
-        msgLen = E.screenCols;
-    if (msgLen && time(NULL) - E.statusMsg_time < 5)
-        abAppend(ab, E.statusMsg, msgLen);
+void checkReset() {
+    while (E.numRows > 0)
+        editorDelRow(E.numRows - 1);
+    if (E.map) {
+        munmap(E.map, E.mapLen);
+        close(E.mapFd);
+        E.map = NULL;
+        E.mapLen = 0;
+        E.mapFd = -1;
+    }
+    free(E.filename);
+    E.filename = NULL;
+    editorUndoClear();
+    E.cx = 0;
+    E.cy = 0;
+    E.dirty = 0;
 }
 
 /**
- * Refresh the terminal screen.
+ * Join the rows into one string, with a line feed after each.
+ *
+ * param ab: The dynamic string to fill.
  */
-void editorRefreshScreen() {
-    editorScroll();
-
-    struct abuf ab = ABUF_INIT;
-
-    abAppend(&ab, "\x1b[?25l", 6); // hide the cursor
-    abAppend(&ab, "\x1b[H", 3); // reposition cursor top-left
-
-    editorDrawRows(&ab); // get the number of tildes for the screen
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1,
-                                              (E.rx - E.colOff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6); // show the cursor again
-
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void checkText(struct abuf *ab) {
+    abReset(ab);
+    int j;
+    for (j = 0; j < E.numRows; j++) {
+        erow *row = tsRow(&E.text, j);
+        abAppend(ab, row->chars, row->size);
+        abAppendByte(ab, '\n');
+    }
 }
 
 /**
- * Set the status message for the kilo editor and note the time it
- * was set.
+ * Print the matches that regexec() and the search found in a row.
  *
- * param fmt: A format string.
+ * param row: Index of the row.
+ * param want: Start and end of each match regexec() found.
+ * param n: Number of matches regexec() found.
  */
-void editorSetStatusMessage(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
-    va_end(ap);
-    E.statusMsg_time = time(NULL);
+void checkPrintMatches(int row, const int *want, int n) {
+    int i;
+    fprintf(stderr, "  regexec:");
+    for (i = 0; i < n; i++)
+        fprintf(stderr, " %d-%d", want[i * 2], want[i * 2 + 1]);
+    fprintf(stderr, "\n  search: ");
+    for (i = 0; i < search.numMatches; i++) {
+        struct searchMatch *m = &search.matches[i];
+        if (m->row == row)
+            fprintf(stderr, " %d-%d", m->offset, m->offset + m->len);
+    }
+    fprintf(stderr, "\n");
 }
 
-/*** input ***/
-
 /**
- * Display a prompt to the user.
+ * Compare every regex search of random lines with what regexec() finds.
  *
- * param prompt: Text to display to the user.
- * param callback: A callback function for incremental searching.
- * return: User input.
+ * return: Number of patterns that disagreed.
  */
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+int checkRegex() {
+    struct abuf pat = ABUF_INIT;
+    struct abuf text = ABUF_INIT;
+    int failed = 0;
+    int t;
+    for (t = 0; t < CHECK_PATTERNS; t++) {
+        abReset(&pat);
+        checkPattern(&pat, 2, 1);
+        abAppendByte(&pat, '\0');
+        int ignoreCase = rand() % 2;
+
+        checkReset();
+        abReset(&text);
+        int j;
+        for (j = 0; j < 8; j++) {
+            checkLine(&text);
+            abAppendByte(&text, '\n');
+        }
+        editorInsertText(text.b, text.len);
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+        regex_t re;
+        if (regcomp(&re, pat.b, REG_EXTENDED | (ignoreCase ? REG_ICASE : 0))) {
+            fprintf(stderr, "regcomp rejected %s\n", pat.b);
+            failed++;
+            continue;
+        }
+        editorSearchEnd();
+        search.flags = SEARCH_REGEX | (ignoreCase ? SEARCH_IGNORE_CASE : 0);
+        editorSearchUpdate(pat.b);
+        if (search.re == NULL) {
+            fprintf(stderr, "reCompile rejected %s: %s\n", pat.b, search.error);
+            failed++;
+            regfree(&re);
+            continue;
+        }
 
-    while(1) {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
-        
-        int c = editorReadKey();
-        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0)
-                buf[--buflen] = '\0';
-        } else if (c == '\x1b'){
-            editorSetStatusMessage("");
-            if (callback)
-                callback(buf, c);
-            free(buf);
-            return NULL;
-         } else if (c == '\r') {
-            if (buflen != 0) {
-                editorSetStatusMessage("");
-                if (callback)
-                    callback(buf, c);
-                return buf;
+        long long k = 0;
+        int ok = 1;
+        for (j = 0; j < E.numRows && ok; j++) {
+            erow *row = tsRow(&E.text, j);
+            char *line = strndup(row->chars, row->size);
+            int *want = malloc(sizeof(int) * (row->size + 1) * 2);
+            if (line == NULL || want == NULL)
+                die("checkRegex: malloc");
+            int n = checkPosixMatches(&re, line, want);
+            int i;
+            for (i = 0; i < n && ok; i++, k++) {
+                struct searchMatch *m = &search.matches[k];
+                ok = (k < search.numMatches && m->row == j &&
+                      m->offset == want[i * 2] &&
+                      m->len == want[i * 2 + 1] - want[i * 2]);
             }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+            if (ok && k < search.numMatches && search.matches[k].row == j)
+                ok = 0;
+            if (!ok) {
+                fprintf(stderr, "regex %s%s differs from regexec on \"%s\"\n",
+                        pat.b, ignoreCase ? " (nocase)" : "", line);
+                checkPrintMatches(j, want, n);
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+            free(line);
+            free(want);
         }
+        if (!ok)
+            failed++;
+        regfree(&re);
+    }
+    editorSearchEnd();
+    abFree(&pat);
+    abFree(&text);
+    return failed;
+}
 
-        if (callback)
-            callback(buf, c);
+/**
+ * Make a random edit at a random place, the way keys and pastes do.
+ */
+void checkEdit() {
+    E.cy = rand() % (E.numRows + 1);
+    E.cx = E.cy < E.numRows ? rand() % (tsRow(&E.text, E.cy)->size + 1) : 0;
+    int kind = rand() % 10;
+    if (kind < 4) {
+        editorInsertChar("ab \t"[rand() % 4]);
+    } else if (kind < 5) {
+        editorInsertNewLine();
+    } else if (kind < 8) {
+        editorDelChar();
+    } else {
+        struct abuf paste = ABUF_INIT;
+        int lines = rand() % 3;
+        checkLine(&paste);
+        while (lines--) {
+            abAppend(&paste, rand() % 2 ? "\n" : "\r\n", 1 + rand() % 2);
+            checkLine(&paste);
+        }
+        editorUndoBreak();
+        editorInsertText(paste.b, paste.len);
+        editorUndoBreak();
+        abFree(&paste);
     }
 }
 
 /**
- * Move the cursor given a specific keypress. 
+ * Make random edits, undo them all and redo them all, and check that the
+ * text comes back each time.
  *
- * param key: A key that has been pressed, encoded as an int.
+ * return: Number of runs that went wrong.
  */
-void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
-
-    switch (key) {
-        case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
-            }
-            break;
-        case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
-            }
-            break;
-        case ARROW_UP:
-            if (E.cy != 0)
-                E.cy--;
-            break;
-        case ARROW_DOWN:
-            if (E.cy < E.numRows)
-                E.cy++;
-            break;
+int checkUndo() {
+    struct abuf before = ABUF_INIT;
+    struct abuf after = ABUF_INIT;
+    struct abuf now = ABUF_INIT;
+    int failed = 0;
+    int t;
+    for (t = 0; t < CHECK_EDIT_RUNS; t++) {
+        checkReset();
+        int j;
+        for (j = 0; j < 5; j++) {
+            checkLine(&now);
+            abAppendByte(&now, '\n');
+        }
+        editorInsertText(now.b, now.len);
+        abReset(&now);
+        editorUndoClear();
+        checkText(&before);
+
+        for (j = 0; j < CHECK_EDITS; j++)
+            checkEdit();
+        checkText(&after);
+
+        while (undo.top > 0)
+            editorUndo();
+        checkText(&now);
+        int ok = (now.len == before.len &&
+                  memcmp(now.b, before.b, now.len) == 0);
+        while (ok && undo.top < undo.end)
+            editorRedo();
+        checkText(&now);
+        ok = ok && now.len == after.len &&
+             memcmp(now.b, after.b, now.len) == 0;
+        if (!ok) {
+            fprintf(stderr, "undo run %d did not restore the text\n", t);
+            failed++;
+        }
     }
-
-    row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
-    int rowLen = row ? row->size : 0;
-    if (E.cx > rowLen)
-        E.cx = rowLen;
+    abFree(&before);
+    abFree(&after);
+    abFree(&now);
+    return failed;
 }
 
 /**
- * Wait for a keypress then handle it.
+ * Make random edits to a file, then open it again and replay its journal,
+ * and check that the text comes out the same.
+ *
+ * param dir: A directory to keep the file in.
+ * return: Number of runs that went wrong.
  */
-void editorProcessKeypress() {
-    static int quit_times = KILO_QUIT_TIMES;
-
-    int c = editorReadKey();
-
-    switch (c) {
-        case '\r':
-            editorInsertNewLine();
-            break;
-
-        case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
-                editorSetStatusMessage("Warning!!! File has unsaved "
-                                       "changes. Press CTRL-Q %d more "
-                                       "times to quit.", quit_times);
-                quit_times--;
-                return;
-            }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-            break;
-
-        case CTRL_KEY('s'):
-         editorSave();
-         break;
-
-        case HOME_KEY:
-            E.cx = 0;
-            break;
-
-        case END_KEY:
-            if (E.cy < E.numRows)
-                E.cx = E.row[E.cy].size;
-            break;
-
-        case CTRL_KEY('f'):
-            editorFind();
-            break;
-    
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DEL_KEY:
-            if (c == DEL_KEY)
-                editorMoveCursor(ARROW_RIGHT);
-            editorDelChar();
-            break;
-    
-        case PAGE_UP:
-        case PAGE_DOWN:
-            {
-                if (c == PAGE_UP) {
-                    E.cy = E.rowOff;
-                } else if (c == PAGE_DOWN){
-                    E.cy = E.rowOff + E.screenRows - 1;
-                    if (E.cy > E.numRows)
-                        E.cy = E.numRows;
-                }
-
-                int times = E.screenRows;
-                while (times--)
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+int checkJournal(const char *dir) {
+    char *path = malloc(strlen(dir) + 8);
+    if (path == NULL)
+        die("checkJournal: malloc");
+    sprintf(path, "%s/file", dir);
+    struct abuf want = ABUF_INIT;
+    struct abuf got = ABUF_INIT;
+    int failed = 0;
+    int t;
+    for (t = 0; t < CHECK_EDIT_RUNS; t++) {
+        checkReset();
+        FILE *fp = fopen(path, "w");
+        if (fp == NULL)
+            die("checkJournal: fopen");
+        int j;
+        for (j = 0; j < 5; j++) {
+            abReset(&want);
+            checkLine(&want);
+            fprintf(fp, "%.*s\n", want.len, want.b);
+        }
+        fclose(fp);
+
+        editorOpen(path);
+        for (j = 0; j < CHECK_EDITS; j++)
+            checkEdit();
+        editorJournalFlush(1);
+        checkText(&want);
+
+        /* Read the journal back and start again from the file. */
+        int ok = 0;
+        int fd = open(journal.path, O_RDONLY);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0) {
+            char *buf = malloc(st.st_size);
+            if (buf && read(fd, buf, st.st_size) == st.st_size) {
+                int headerLen = journal.headerLen;
+                checkReset();
+                editorOpen(path);
+                const char *end = editorJournalReplay(&buf[headerLen],
+                                                      &buf[st.st_size]);
+                checkText(&got);
+                ok = (end == &buf[st.st_size] && got.len == want.len &&
+                      memcmp(got.b, want.b, got.len) == 0);
             }
-            break;
-
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            editorMoveCursor(c);
-            break;
-
-        case CTRL_KEY('l'):
-        case '\x1b':
-            break;
-
-        default:
-            editorInsertChar(c);
-            break;
+            free(buf);
+        }
+        if (fd != -1)
+            close(fd);
+        if (!ok) {
+            fprintf(stderr, "journal run %d did not replay to the same "
+                    "text\n", t);
+            failed++;
+        }
+        editorJournalRemove();
     }
+    checkReset();
+    unlink(path);
+    free(path);
+    abFree(&want);
+    abFree(&got);
+    return failed;
+}
 
-    quit_times = KILO_QUIT_TIMES;
+/**
+ * Run the randomized checks. A seed can be given to repeat a run.
+ *
+ * param argc: Number of arguments.
+ * param argv: The arguments.
+ * return: 0 if every check passed, 1 if not.
+ */
+int checkMain(int argc, char **argv) {
+    unsigned int seed = argc >= 2 ? strtoul(argv[1], NULL, 10)
+                                  : (unsigned int)time(NULL);
+    srand(seed);
+    printf("seed %u\n", seed);
+
+    char dir[] = "/tmp/kilo-check.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("checkMain: mkdtemp");
+    E.headless = 1;
+    E.screenRows = 24;
+    E.screenCols = 80;
+    initEditor();
+    /* Edits are journaled as they would be in a terminal. */
+    E.headless = 0;
+
+    int failed = 0;
+    int n = checkRegex();
+    printf("regex against regexec: %d of %d patterns differ\n", n,
+           CHECK_PATTERNS);
+    failed += n;
+    n = checkUndo();
+    printf("undo all and redo all: %d of %d runs differ\n", n,
+           CHECK_EDIT_RUNS);
+    failed += n;
+    n = checkJournal(dir);
+    printf("journal replay: %d of %d runs differ\n", n, CHECK_EDIT_RUNS);
+    failed += n;
+    rmdir(dir);
+    return failed ? 1 : 0;
 }
 
+#endif
+
 /*** init ***/
 
 /**
@@ -1306,29 +6569,54 @@ void initEditor() {
     E.rowOff = 0;
     E.colOff = 0;
     E.numRows = 0;
-    E.row = NULL;
+    E.hlValidRows = 0;
+    E.hlDirtyEnd = 0;
+    E.hlGen = 0;
+    E.text = (struct textStore)TEXTSTORE_INIT;
     E.dirty = 0;
     E.filename = NULL;
     E.statusMsg[0] = '\0';
     E.statusMsg_time = 0;
+    E.prompting = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
+    E.map = NULL;
+    E.mapLen = 0;
+    E.mapFd = -1;
+    /* The umask can only be read by setting it, which would race with
+     * files being created on other threads, so it is read once here. */
+    E.umask = umask(0);
+    umask(E.umask);
+
+    /* A headless editor keeps the size it was given. */
+    if (!E.headless && getWindowSize(&E.screenRows, &E.screenCols) == -1)
         die("initEditor: getWindowSize");
     E.screenRows -= 2;
+    screenResize();
 }
 
 int main(int argc, char **argv) {
+#ifdef KILO_BENCH
+    return benchMain(argc, argv);
+#endif
+#ifdef KILO_CHECK
+    return checkMain(argc, argv);
+#endif
     enableRawMode();
     initEditor();
+    editorInitEvents();
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+                           "Ctrl-Z = undo");
     if (argc >= 2)
         editorOpen(argv[1]);
-
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorJournalRecover();
 
     while (1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        editorHighlightInBackground();
+        do {
+            editorProcessKeypress();
+            editorScroll(); // keys like page up depend on the view
+        } while (inputPending() || editorWaitForFrame());
     }
 
     return 0;